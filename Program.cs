@@ -1,12 +1,15 @@
 ﻿using System.Text.Json;
 using System.Diagnostics;
 using System.Text;
+using System.Collections.Concurrent;
+using System.Threading.Channels;
 
 class Program
 {
     static string botUsername = "";
     static readonly HttpClient client = new HttpClient();
-    
+    static readonly EngineServer engine = new EngineServer("./engine/bin/Neptune");
+    static int activeGames = 0;
 
     static async Task Main(string[] args)
     {
@@ -36,7 +39,7 @@ class Program
 
             var type = typeElement.GetString();
 
-            if (type == "gameStart") await HandleGameStart(doc);
+            if (type == "gameStart") _ = HandleGameStart(doc);
             else if (type == "challenge") await HandleChallenge(doc);
         }
     }
@@ -49,7 +52,15 @@ class Program
         var gameId = idElement.GetString();
         if (string.IsNullOrEmpty(gameId)) return;
 
-        await HandleGame(gameId);
+        Interlocked.Increment(ref activeGames);
+        try
+        {
+            await HandleGame(gameId);
+        }
+        finally
+        {
+            Interlocked.Decrement(ref activeGames);
+        }
     }
 
     static async Task HandleChallenge(JsonDocument doc)
@@ -74,6 +85,7 @@ class Program
 
     static async Task HandleGame(string gameId)
     {
+        engine.Open(gameId);
         try
         {
             var url = $"https://lichess.org/api/bot/game/stream/{gameId}";
@@ -86,6 +98,10 @@ class Program
         {
             Console.WriteLine($"[ERROR] {ex.Message}\n{ex.StackTrace}");
         }
+        finally
+        {
+            await engine.Close(gameId);
+        }
     }
 
     static async Task HandleGameStream(StreamReader reader, string gameId)
@@ -93,32 +109,9 @@ class Program
         string? color = null;
         string? fen = null;
         List<string> moves = new();
+        string clock = "wtime 30000 btime 30000";
         int lastMoveCount = -1;
-
-        using var engine = new Process
-        {
-            StartInfo = new ProcessStartInfo
-            {
-                FileName = "./engine/bin/Neptune",
-                RedirectStandardInput = true,
-                RedirectStandardOutput = true,
-                RedirectStandardError = true,
-                UseShellExecute = false,
-                CreateNoWindow = true
-            },
-            EnableRaisingEvents = true
-        };
-
-        engine.Start();
-
-        _ = Task.Run(async () =>
-        {
-            string? errorLine;
-            while ((errorLine = await engine.StandardError.ReadLineAsync()) != null)
-            {
-                Console.WriteLine("[ENGINE-ERR] " + errorLine);
-            }
-        });
+        string? ponderMove = null; // reply the engine is pondering on, if any
 
         while (!reader.EndOfStream)
         {
@@ -130,11 +123,13 @@ class Program
 
             if (type == "gameFull")
             {
-                HandleGameFull(doc, ref color, ref fen, ref moves, engine);
+                HandleGameFull(doc, ref color, ref fen, ref moves);
+                if (doc.RootElement.TryGetProperty("state", out var state)) clock = ReadClock(state, clock);
             }
             else if (type == "gameState")
             {
                 HandleGameState(doc, ref moves);
+                clock = ReadClock(doc.RootElement, clock);
 
                 if (doc.RootElement.TryGetProperty("status", out var statusElement))
                 {
@@ -142,7 +137,6 @@ class Program
                     if (status != "started")
                     {
                         //Console.WriteLine($"[INFO] Game ended or aborted (status: {status})");
-                        engine.Kill();
                         break;
                     }
                 }
@@ -153,9 +147,33 @@ class Program
                 IsMyTurn(color, moves.Count) &&
                 (moves.Count != lastMoveCount))
             {
-                var move = await GetBestMoveFromEngine(fen, moves, engine);
-                await SendMove(gameId, move.Trim());
+                (string move, string? ponder) best;
+                if (ponderMove != null && moves.Count > 0 && moves[moves.Count - 1] == ponderMove)
+                {
+                    await engine.Send(gameId, "ponderhit");
+                    best = await ReadBestMove(gameId);
+                }
+                else
+                {
+                    if (ponderMove != null)
+                    {
+                        // Wrong prediction: the engine takes it back once stopped, its answer is discarded
+                        await engine.Send(gameId, "stop");
+                        await ReadBestMove(gameId);
+                    }
+                    best = await GetBestMoveFromEngine(gameId, fen, moves, clock);
+                }
+                ponderMove = null;
+
+                await SendMove(gameId, best.move.Trim());
                 lastMoveCount = moves.Count;
+
+                // Pondering holds one of the engine's search workers, so it is only worth it without other games
+                if (best.ponder != null && Volatile.Read(ref activeGames) == 1)
+                {
+                    await StartPondering(gameId, fen, moves, best.move.Trim(), best.ponder, clock);
+                    ponderMove = best.ponder;
+                }
             }
         }
     }
@@ -170,7 +188,19 @@ class Program
         }
     }
 
-    static void HandleGameFull(JsonDocument doc, ref string? color, ref string? fen, ref List<string> moves, Process engine)
+    // Builds the "wtime .. btime .. winc .. binc .." arguments of go from a gameState object
+    static string ReadClock(JsonElement state, string fallback)
+    {
+        var parts = new List<string>();
+        foreach (var name in new[] { "wtime", "btime", "winc", "binc" })
+        {
+            if (state.TryGetProperty(name, out var value) && value.TryGetInt64(out var ms))
+                parts.Add($"{name} {ms}");
+        }
+        return parts.Count > 0 ? string.Join(' ', parts) : fallback;
+    }
+
+    static void HandleGameFull(JsonDocument doc, ref string? color, ref string? fen, ref List<string> moves)
     {
         if (doc.RootElement.TryGetProperty("white", out var white) &&
             white.TryGetProperty("id", out var whiteIdElement))
@@ -187,9 +217,6 @@ class Program
             fen = fenElement.GetString();
             if (fen == "startpos")
                 fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
-
-            engine.StandardInput.WriteLineAsync($"initial {fen}");
-            engine.StandardInput.FlushAsync();
         }
 
         if (doc.RootElement.TryGetProperty("state", out var state) &&
@@ -213,25 +240,45 @@ class Program
                (color == "black" && moveCount % 2 == 1);
     }
 
-    static async Task<string> GetBestMoveFromEngine(string fen, List<string> moves, Process engine)
+    // The whole game goes with every request, so a dropped or replayed stream event cannot desync the engine.
+    // The engine only plays the moves it does not have yet
+    static string PositionCommand(string fen, IEnumerable<string> moves)
     {
-        string latestMove = moves.Count > 0 ? moves[moves.Count - 1] : "start";
+        var list = string.Join(' ', moves);
+        return list.Length > 0 ? $"position fen {fen} moves {list}" : $"position fen {fen}";
+    }
 
-        await engine.StandardInput.WriteLineAsync($"move {latestMove}");
-        await engine.StandardInput.WriteLineAsync("go wtime 30000 btime 30000");
-        await engine.StandardInput.FlushAsync();
+    static async Task<(string move, string? ponder)> GetBestMoveFromEngine(string gameId, string fen, List<string> moves, string clock)
+    {
+        await engine.Send(gameId, PositionCommand(fen, moves));
+        await engine.Send(gameId, $"go {clock}");
 
+        return await ReadBestMove(gameId);
+    }
+
+    // Plays the predicted reply on the engine's board and lets it think on the opponent's time
+    static async Task StartPondering(string gameId, string fen, List<string> moves, string ourMove, string predicted, string clock)
+    {
+        await engine.Send(gameId, PositionCommand(fen, moves.Append(ourMove).Append(predicted)));
+        await engine.Send(gameId, $"go ponder {clock}");
+    }
+
+    // Reads the game's engine output up to "bestmove <move> [ponder <move>]"
+    static async Task<(string move, string? ponder)> ReadBestMove(string gameId)
+    {
         string? line;
-        while ((line = await engine.StandardOutput.ReadLineAsync()) != null)
+        while ((line = await engine.ReadLine(gameId)) != null)
         {
-            if (line.StartsWith("[TIME]") || line.StartsWith("[LOG]")) Console.WriteLine(line);
+            if (line.StartsWith("info string") || line.StartsWith("[LOG]")) Console.WriteLine(line);
             if (line.StartsWith("bestmove"))
             {
-                return line.Split(' ')[1];
+                var parts = line.Split(' ', StringSplitOptions.RemoveEmptyEntries);
+                string? ponder = parts.Length >= 4 && parts[2] == "ponder" ? parts[3] : null;
+                return (parts[1], ponder);
             }
         }
 
-        return "0000";
+        return ("0000", null);
     }
 
     static async Task SendMove(string gameId, string move)
@@ -258,4 +305,93 @@ class Program
             Console.WriteLine($"[ERROR] Response content: {errorBody}");
         }
     }
-}
\ No newline at end of file
+}
+
+// One engine process shared by every game. Commands and replies are tagged "game <id>", and a reader
+// task hands each reply to the game it belongs to
+class EngineServer
+{
+    readonly Process process;
+    readonly SemaphoreSlim writeLock = new(1, 1);
+    readonly ConcurrentDictionary<string, Channel<string>> games = new();
+
+    public EngineServer(string path)
+    {
+        process = new Process
+        {
+            StartInfo = new ProcessStartInfo
+            {
+                FileName = path,
+                RedirectStandardInput = true,
+                RedirectStandardOutput = true,
+                RedirectStandardError = true,
+                UseShellExecute = false,
+                CreateNoWindow = true
+            },
+            EnableRaisingEvents = true
+        };
+        process.Start();
+
+        _ = Task.Run(ReadReplies);
+        _ = Task.Run(async () =>
+        {
+            string? errorLine;
+            while ((errorLine = await process.StandardError.ReadLineAsync()) != null)
+            {
+                Console.WriteLine("[ENGINE-ERR] " + errorLine);
+            }
+        });
+    }
+
+    async Task ReadReplies()
+    {
+        string? line;
+        while ((line = await process.StandardOutput.ReadLineAsync()) != null)
+        {
+            var parts = line.Split(' ', 3);
+            if (parts.Length == 3 && parts[0] == "game" && games.TryGetValue(parts[1], out var channel))
+                channel.Writer.TryWrite(parts[2]);
+        }
+        foreach (var channel in games.Values) channel.Writer.TryComplete();
+    }
+
+    public void Open(string gameId)
+    {
+        games[gameId] = Channel.CreateUnbounded<string>();
+    }
+
+    // Ends the game's session in the engine, stopping any search it still runs
+    public async Task Close(string gameId)
+    {
+        await Send(gameId, "quit");
+        if (games.TryRemove(gameId, out var channel)) channel.Writer.TryComplete();
+    }
+
+    public async Task Send(string gameId, string command)
+    {
+        await writeLock.WaitAsync();
+        try
+        {
+            await process.StandardInput.WriteLineAsync($"game {gameId} {command}");
+            await process.StandardInput.FlushAsync();
+        }
+        finally
+        {
+            writeLock.Release();
+        }
+    }
+
+    // Next reply for the game, null once the engine or the game's session is gone
+    public async Task<string?> ReadLine(string gameId)
+    {
+        if (!games.TryGetValue(gameId, out var channel)) return null;
+        try
+        {
+            return await channel.Reader.ReadAsync();
+        }
+        catch (ChannelClosedException)
+        {
+            return null;
+        }
+    }
+}
@@ -1,21 +1,57 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <array>
 #include <cstdint>
 #include <sstream>
+#include <fstream>
+#include <iomanip>
 #include <cctype>
 #include <iterator>
-#include <random>
 #include <chrono>
 #include <cstring>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <memory>
+#include <cstdlib>
+#include <climits>
+#include <cmath>
+#include <ctime>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#endif
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#if defined(__BMI2__) && !defined(NEPTUNE_NO_PEXT)
+#define USE_PEXT // Slider lookups index with pext instead of a magic multiply
+#endif
+
+#if defined(__AVX2__) && !defined(NEPTUNE_NO_AVX2)
+#define USE_AVX2_FILL // Whole-side slider fills run four directions per 256-bit register
+#endif
 
 using namespace std;
 
 constexpr int bishopDirs[4][2] = {{1, 1}, {1, -1}, {-1, 1}, {-1, -1}};
 constexpr int rookDirs[4][2] = {{0, 1}, {0, -1}, {-1, 0}, {1, 0}};
-constexpr int queenDirs[8][2] = {{1, 1}, {1, -1}, {-1, 1}, {-1, -1}, {0, 1}, {0, -1}, {-1, 0}, {1, 0}};
 constexpr int knightDirs[8][2] = {{2, 1}, {1, 2}, {-1, 2}, {-2, 1}, {-2, -1}, {-1, -2}, {1, -2}, {2, -1}};
 constexpr int kingDirs[8][2] = {{1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1}, {1, 0}};
 
@@ -147,7 +183,146 @@ constexpr uint64_t rank6 = 0x0000FF0000000000ULL;
 constexpr uint64_t rank7 = 0x00FF000000000000ULL;
 constexpr uint64_t rank8 = 0xFF00000000000000ULL;
 
+constexpr uint64_t fileA = 0x0101010101010101ULL;
+constexpr uint64_t fileH = 0x8080808080808080ULL;
+
+// Magic bitboards: every slider attack set is one table load indexed by the relevant blockers.
+// With BMI2 available at build time the index is pext(occupied, mask), otherwise a magic multiply.
+struct Magic {
+    uint64_t mask;
+    uint64_t magic;
+    uint64_t* attacks;
+    unsigned shift;
+
+    unsigned index(uint64_t occupied) const {
+#ifdef USE_PEXT
+        return (unsigned)_pext_u64(occupied, mask);
+#else
+        return (unsigned)(((occupied & mask) * magic) >> shift);
+#endif
+    }
+};
+
+Magic bishopMagics[64];
+Magic rookMagics[64];
+uint64_t bishopTable[0x1480];
+uint64_t rookTable[0x19000];
+
+inline uint64_t BishopAttacks(int sq, uint64_t occupied) {
+    const Magic& m = bishopMagics[sq];
+    return m.attacks[m.index(occupied)];
+}
+
+inline uint64_t RookAttacks(int sq, uint64_t occupied) {
+    const Magic& m = rookMagics[sq];
+    return m.attacks[m.index(occupied)];
+}
+
+inline uint64_t QueenAttacks(int sq, uint64_t occupied) {
+    return BishopAttacks(sq, occupied) | RookAttacks(sq, occupied);
+}
+
+// Ray walk used only to fill the magic tables
+uint64_t SlidingAttacksSlow(int sq, const int directions[][2], uint64_t occupied) {
+    int rank = sq >> 3;
+    int file = sq & 7;
+    uint64_t attacks = 0;
+
+    for (int d = 0; d < 4; d++) {
+        int r = rank + directions[d][0];
+        int f = file + directions[d][1];
+        while (r >= 0 && r < 8 && f >= 0 && f < 8) {
+            uint64_t targetBB = 1ULL << (r * 8 + f);
+            attacks |= targetBB;
+            if (occupied & targetBB) break;
+            r += directions[d][0];
+            f += directions[d][1];
+        }
+    }
+    return attacks;
+}
+
+void InitMagics(Magic magics[64], uint64_t* table, const int directions[][2]) {
+#ifndef USE_PEXT
+    // Fixed per-rank seeds that find all magics quickly, so startup is deterministic
+    constexpr uint64_t seeds[8] = {728, 10316, 55013, 32803, 12281, 15100, 16645, 255};
+    uint64_t occupancy[4096], reference[4096];
+    int epoch[4096] = {}, attempt = 0;
+#endif
+    uint64_t* next = table;
+
+    for (int sq = 0; sq < 64; sq++) {
+        uint64_t rankBB = rank1 << (8 * (sq >> 3));
+        uint64_t fileBB = fileA << (sq & 7);
+        uint64_t edges = ((rank1 | rank8) & ~rankBB) | ((fileA | fileH) & ~fileBB);
+
+        Magic& m = magics[sq];
+        m.mask = SlidingAttacksSlow(sq, directions, 0) & ~edges;
+        m.shift = 64 - __builtin_popcountll(m.mask);
+        m.attacks = next;
+
+        // Carry-Rippler enumeration of every blocker subset of the mask
+        int size = 0;
+        uint64_t b = 0;
+        do {
+#ifdef USE_PEXT
+            m.attacks[_pext_u64(b, m.mask)] = SlidingAttacksSlow(sq, directions, b);
+#else
+            occupancy[size] = b;
+            reference[size] = SlidingAttacksSlow(sq, directions, b);
+#endif
+            size++;
+            b = (b - m.mask) & m.mask;
+        } while (b);
+        next += size;
+
+#ifndef USE_PEXT
+        uint64_t state = seeds[sq >> 3];
+        auto rand64 = [&state] {
+            state ^= state >> 12; state ^= state << 25; state ^= state >> 27;
+            return state * 2685821657736338717ULL;
+        };
+
+        for (int i = 0; i < size; ) {
+            do {
+                m.magic = rand64() & rand64() & rand64();
+            } while (__builtin_popcountll((m.magic * m.mask) >> 56) < 6);
+
+            // epoch[] marks which slots were written by this attempt, so the table needs no clearing
+            attempt++;
+            for (i = 0; i < size; i++) {
+                unsigned idx = m.index(occupancy[i]);
+                if (epoch[idx] < attempt) {
+                    epoch[idx] = attempt;
+                    m.attacks[idx] = reference[i];
+                } else if (m.attacks[idx] != reference[i]) {
+                    break;
+                }
+            }
+        }
+#endif
+    }
+}
+
+// Squares strictly between two aligned squares, and the whole line through them (empty when not aligned)
+uint64_t betweenBB[64][64];
+uint64_t lineBB[64][64];
 
+void InitLines() {
+    for (int a = 0; a < 64; a++) {
+        for (int b = 0; b < 64; b++) {
+            if (a == b) continue;
+            uint64_t aBB = 1ULL << a, bBB = 1ULL << b;
+            if (BishopAttacks(a, 0) & bBB) {
+                lineBB[a][b] = (BishopAttacks(a, 0) & BishopAttacks(b, 0)) | aBB | bBB;
+                betweenBB[a][b] = BishopAttacks(a, bBB) & BishopAttacks(b, aBB);
+            } else if (RookAttacks(a, 0) & bBB) {
+                lineBB[a][b] = (RookAttacks(a, 0) & RookAttacks(b, 0)) | aBB | bBB;
+                betweenBB[a][b] = RookAttacks(a, bBB) & RookAttacks(b, aBB);
+            }
+        }
+    }
+}
 
 enum Piece {
     EMPTY, PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING
@@ -157,23 +332,178 @@ enum Color {
     WHITE, BLACK
 };
 
+constexpr Color operator~(Color color) {
+    return Color(color ^ 1);
+}
+
+// Mailbox byte: the piece type in the low 3 bits and the color in bit 3, so an empty square is 0
+constexpr uint8_t MakePiece(int color, Piece piece) {
+    return (uint8_t)(piece | color << 3);
+}
+
+constexpr Piece PieceType(uint8_t piece) {
+    return Piece(piece & 7);
+}
+
+constexpr Color PieceColor(uint8_t piece) {
+    return Color(piece >> 3);
+}
+
+// Zobrist keys, filled once at startup from a fixed seed so hashes are reproducible between runs
+uint64_t zobristPieces[2][7][64]; // [color][piece][square], the EMPTY row stays zero
+uint64_t zobristCastling[16];
+uint64_t zobristEnPassant[8]; // by file
+uint64_t zobristSide; // xored in when black is to move
+
+void InitZobrist() {
+    uint64_t state = 0x4E657074756E6521ULL;
+    auto rand64 = [&state] {
+        state ^= state >> 12; state ^= state << 25; state ^= state >> 27;
+        return state * 2685821657736338717ULL;
+    };
+
+    for (int color = 0; color < 2; color++)
+        for (int piece = PAWN; piece <= KING; piece++)
+            for (int sq = 0; sq < 64; sq++)
+                zobristPieces[color][piece][sq] = rand64();
+    for (uint64_t& key : zobristCastling) key = rand64();
+    for (uint64_t& key : zobristEnPassant) key = rand64();
+    zobristSide = rand64();
+}
+
+constexpr uint64_t fileB = fileA << 1;
+constexpr uint64_t fileG = fileH >> 1;
+
+inline uint64_t PawnAttacksSetwise(uint64_t pawns, int color) {
+    return color == WHITE ? ((pawns << 7) & ~fileH) | ((pawns << 9) & ~fileA)
+                          : ((pawns >> 9) & ~fileH) | ((pawns >> 7) & ~fileA);
+}
+
+inline uint64_t KnightAttacksSetwise(uint64_t knights) {
+    uint64_t l1 = (knights >> 1) & ~fileH;
+    uint64_t l2 = (knights >> 2) & ~(fileG | fileH);
+    uint64_t r1 = (knights << 1) & ~fileA;
+    uint64_t r2 = (knights << 2) & ~(fileA | fileB);
+    uint64_t h1 = l1 | r1;
+    uint64_t h2 = l2 | r2;
+    return (h1 << 16) | (h1 >> 16) | (h2 << 8) | (h2 >> 8);
+}
+
+inline uint64_t KingAttacksSetwise(uint64_t kings) {
+    uint64_t row = kings | ((kings << 1) & ~fileA) | ((kings >> 1) & ~fileH);
+    return (row | (row << 8) | (row >> 8)) ^ kings;
+}
+
+template<int Shift>
+constexpr uint64_t ShiftBB(uint64_t bb) {
+    if constexpr (Shift > 0) return bb << Shift;
+    else return bb >> -Shift;
+}
+
+// Kogge-Stone occluded fill: every slider in gen spreads one direction through the empty squares
+// in three doubling steps, so the cost does not depend on how many sliders there are. The result
+// is the attacked squares, the first blocker included. Mask drops squares that wrapped around a file edge
+template<int Shift, uint64_t Mask>
+inline uint64_t SlideSetwise(uint64_t gen, uint64_t empty) {
+    uint64_t pro = empty & Mask;
+    gen |= pro & ShiftBB<Shift>(gen);
+    pro &= ShiftBB<Shift>(pro);
+    gen |= pro & ShiftBB<2 * Shift>(gen);
+    pro &= ShiftBB<2 * Shift>(pro);
+    gen |= pro & ShiftBB<4 * Shift>(gen);
+    return ShiftBB<Shift>(gen) & Mask;
+}
+
+#ifdef USE_AVX2_FILL
+// One 256-bit register carries four directions at once: lanes hold north, east, north-east and
+// north-west for the left shifts, south, west, south-west and south-east for the right shifts
+inline __m256i SlideSetwiseAvx2(__m256i gen, __m256i empty, __m256i shift, __m256i mask, bool left) {
+    auto step = [left](__m256i bb, __m256i amount) {
+        return left ? _mm256_sllv_epi64(bb, amount) : _mm256_srlv_epi64(bb, amount);
+    };
+    __m256i pro = _mm256_and_si256(empty, mask);
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, step(gen, shift)));
+    pro = _mm256_and_si256(pro, step(pro, shift));
+    __m256i shift2 = _mm256_add_epi64(shift, shift);
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, step(gen, shift2)));
+    pro = _mm256_and_si256(pro, step(pro, shift2));
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, step(gen, _mm256_add_epi64(shift2, shift2))));
+    return _mm256_and_si256(step(gen, shift), mask);
+}
+#endif
+
+// Attacks of all diagonal and all straight sliders of one side together
+inline uint64_t SliderAttacksSetwise(uint64_t diagonal, uint64_t straight, uint64_t occupied) {
+    uint64_t empty = ~occupied;
+#ifdef USE_AVX2_FILL
+    const __m256i shift = _mm256_setr_epi64x(8, 1, 9, 7);
+    const __m256i leftMask = _mm256_setr_epi64x(~0LL, (long long)~fileA, (long long)~fileA, (long long)~fileH);
+    const __m256i rightMask = _mm256_setr_epi64x(~0LL, (long long)~fileH, (long long)~fileH, (long long)~fileA);
+    __m256i gen = _mm256_setr_epi64x(straight, straight, diagonal, diagonal);
+    __m256i emptyAll = _mm256_set1_epi64x(empty);
+    __m256i result = _mm256_or_si256(SlideSetwiseAvx2(gen, emptyAll, shift, leftMask, true),
+                                     SlideSetwiseAvx2(gen, emptyAll, shift, rightMask, false));
+    __m128i half = _mm_or_si128(_mm256_castsi256_si128(result), _mm256_extracti128_si256(result, 1));
+    return _mm_cvtsi128_si64(_mm_or_si128(half, _mm_unpackhi_epi64(half, half)));
+#else
+    return SlideSetwise<8, ~0ULL>(straight, empty) | SlideSetwise<-8, ~0ULL>(straight, empty)
+         | SlideSetwise<1, ~fileA>(straight, empty) | SlideSetwise<-1, ~fileH>(straight, empty)
+         | SlideSetwise<9, ~fileA>(diagonal, empty) | SlideSetwise<7, ~fileH>(diagonal, empty)
+         | SlideSetwise<-7, ~fileA>(diagonal, empty) | SlideSetwise<-9, ~fileH>(diagonal, empty);
+#endif
+}
+
+enum MoveType : uint16_t {
+    NORMAL, PROMOTION = 1 << 14, EN_PASSANT = 2 << 14, CASTLING = 3 << 14
+};
+
+// 16-bit move: bits 0-5 from, 6-11 to, 12-13 promotion piece (knight to queen), 14-15 MoveType.
+// The default constructor leaves it uninitialized so move lists cost nothing to declare
 struct Move {
-    int from;
-    int to;
-    char promotion = 0;
-    bool isEnPassant = false;
+    uint16_t data;
+
+    Move() = default;
+    constexpr Move(int from, int to, MoveType type = NORMAL, Piece promotion = KNIGHT)
+        : data((uint16_t)(from | (to << 6) | ((promotion - KNIGHT) << 12) | type)) {}
 
-    Move(int From, int To, char Promotion = 0, bool EP = false) : from(From), to(To), promotion(Promotion), isEnPassant(EP) {}
+    int from() const { return data & 63; }
+    int to() const { return (data >> 6) & 63; }
+    MoveType type() const { return (MoveType)(data & (3 << 14)); }
+    Piece promotion() const { return (Piece)(((data >> 12) & 3) + KNIGHT); }
+
+    bool isPromotion() const { return type() == PROMOTION; }
+    bool isEnPassant() const { return type() == EN_PASSANT; }
+    bool isCastling() const { return type() == CASTLING; }
+
+    bool operator==(Move other) const { return data == other.data; }
+    bool operator!=(Move other) const { return data != other.data; }
 };
 
-constexpr array<Piece, 128> promotionCharToPiece = [] {
-    array<Piece, 128> table{};
-    table['q'] = QUEEN;
-    table['r'] = ROOK;
-    table['b'] = BISHOP;
-    table['n'] = KNIGHT;
-    return table;
-}();
+constexpr Move NO_MOVE = Move(a1, a1);
+
+// A move plus room for the score move ordering sorts by
+struct ScoredMove {
+    Move move;
+    int16_t score;
+
+    operator Move() const { return move; }
+};
+
+// Fixed-capacity move list that lives on the stack, no position has more than 218 legal moves
+struct MoveList {
+    ScoredMove moves[256];
+    int count = 0;
+
+    void add(Move move) { moves[count++].move = move; }
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    Move operator[](int i) const { return moves[i].move; }
+    ScoredMove* begin() { return moves; }
+    ScoredMove* end() { return moves + count; }
+    const ScoredMove* begin() const { return moves; }
+    const ScoredMove* end() const { return moves + count; }
+};
 
 string indexToSquare(int index) {
     int file = index & 7;  // 0 to 7
@@ -198,20 +528,428 @@ Piece charToPiece(char pieceChar) {
     }
 }
 
-class Board {
+// Transposition table: buckets of four entries fill one cache line. Each entry stores key ^ data next
+// to data, so a write torn by another thread fails verification instead of returning a wrong entry.
+enum Bound : uint8_t {
+    BOUND_NONE, BOUND_UPPER, BOUND_LOWER, BOUND_EXACT
+};
+
+struct TTData {
+    Move move;
+    int16_t score;
+    int8_t depth;
+    Bound bound;
+};
+
+struct TTEntry {
+    atomic<uint64_t> check; // key ^ data
+    atomic<uint64_t> data;  // move | score << 16 | depth << 32 | bound << 40 | age << 42
+};
+
+struct alignas(64) TTBucket {
+    TTEntry entries[4];
+};
+
+class TranspositionTable {
+public:
+    TranspositionTable() { resize(16); }
+
+    ~TranspositionTable() { free(buckets); }
+
+    // Reallocates the table with the largest bucket count fitting in megabytes, and clears it.
+    // Tables of 2 MB or more are aligned for, and advised to use, transparent huge pages on Linux.
+    void resize(size_t megabytes) {
+        free(buckets);
+        bucketCount = max<size_t>(1, (megabytes << 20) / sizeof(TTBucket));
+        size_t bytes = bucketCount * sizeof(TTBucket);
+        size_t alignment = bytes >= (2u << 20) ? (2u << 20) : 64;
+        buckets = (TTBucket*)aligned_alloc(alignment, (bytes + alignment - 1) / alignment * alignment);
+        if (!buckets) {
+            cerr << "[ERROR] Failed to allocate " << megabytes << " MB for the hash table\n";
+            bucketCount = 0;
+            return;
+        }
+#ifdef __linux__
+        if (alignment > 64) madvise(buckets, bytes, MADV_HUGEPAGE);
+#endif
+        clear();
+    }
+
+    void clear() {
+        for (size_t i = 0; i < bucketCount; i++) {
+            for (TTEntry& e : buckets[i].entries) {
+                e.check.store(0, memory_order_relaxed);
+                e.data.store(0, memory_order_relaxed);
+            }
+        }
+        age = 0;
+    }
+
+    // Called once per search so entries from earlier moves lose replacement priority
+    void newSearch() { age = (age + 1) & 63; }
+
+    void prefetch(uint64_t key) const {
+        if (bucketCount) __builtin_prefetch(&buckets[index(key)]);
+    }
+
+    bool probe(uint64_t key, TTData& out) const {
+        if (!bucketCount) return false;
+        const TTBucket& bucket = buckets[index(key)];
+        for (const TTEntry& e : bucket.entries) {
+            uint64_t data = e.data.load(memory_order_relaxed);
+            if ((e.check.load(memory_order_relaxed) ^ data) != key || data == 0) continue;
+            out.move.data = (uint16_t)data;
+            out.score = (int16_t)(data >> 16);
+            out.depth = (int8_t)(data >> 32);
+            out.bound = (Bound)((data >> 40) & 3);
+            return true;
+        }
+        return false;
+    }
+
+    // Overwrites the entry for key if present, otherwise the least valuable one in the bucket:
+    // the shallowest, with every search of age counting as eight plies of depth
+    void store(uint64_t key, int depth, int score, Bound bound, Move move) {
+        if (!bucketCount) return;
+        TTBucket& bucket = buckets[index(key)];
+        TTEntry* replace = &bucket.entries[0];
+        int worst = INT32_MAX;
+
+        for (TTEntry& e : bucket.entries) {
+            uint64_t data = e.data.load(memory_order_relaxed);
+            if ((e.check.load(memory_order_relaxed) ^ data) == key) {
+                // Keep the old move and deeper results from this search for the same position
+                if (move == NO_MOVE) move.data = (uint16_t)data;
+                if (bound != BOUND_EXACT && (int)((data >> 42) & 63) == age && (int8_t)(data >> 32) > depth + 2) return;
+                replace = &e;
+                break;
+            }
+            int relativeAge = (age - (int)((data >> 42) & 63)) & 63;
+            int value = (int8_t)(data >> 32) - 8 * relativeAge;
+            if (data == 0) value = INT32_MIN;
+            if (value < worst) {
+                worst = value;
+                replace = &e;
+            }
+        }
+
+        uint64_t data = (uint64_t)move.data | ((uint64_t)(uint16_t)score << 16) | ((uint64_t)(uint8_t)depth << 32)
+                      | ((uint64_t)bound << 40) | ((uint64_t)age << 42);
+        replace->check.store(key ^ data, memory_order_relaxed);
+        replace->data.store(data, memory_order_relaxed);
+    }
+
+    // Permille of sampled entries written by the current search, for UCI "hashfull"
+    int hashfull() const {
+        int used = 0, sampled = 0;
+        for (size_t i = 0; i < min<size_t>(bucketCount, 250); i++) {
+            for (const TTEntry& e : buckets[i].entries) {
+                uint64_t data = e.data.load(memory_order_relaxed);
+                used += data != 0 && (int)((data >> 42) & 63) == age;
+                sampled++;
+            }
+        }
+        return sampled ? used * 1000 / sampled : 0;
+    }
+
+private:
+    // Multiply-shift maps the key onto any bucket count, so the size need not be a power of two
+    size_t index(uint64_t key) const {
+        return (size_t)(((unsigned __int128)key * bucketCount) >> 64);
+    }
+
+    TTBucket* buckets = nullptr;
+    size_t bucketCount = 0;
+    atomic<int> age{0}; // bumped by concurrent searches of different games in server mode
+};
+
+TranspositionTable TT;
+
+// Tapered evaluation scores pack the midgame value in the low and the endgame value in the high
+// 16 bits of one int, so a single addition updates both phases
+constexpr int S(int mg, int eg) {
+    return (int)((unsigned)eg << 16) + mg;
+}
+
+inline int MgScore(int score) {
+    return (int16_t)(uint16_t)(unsigned)score;
+}
+
+inline int EgScore(int score) {
+    return (int16_t)(uint16_t)((unsigned)(score + 0x8000) >> 16);
+}
+
+// Game phase: 24 with all minor and major pieces on the board, 0 in a pawn ending
+constexpr int phaseWeight[7] = {0, 0, 1, 1, 2, 4, 0};
+constexpr int MAX_PHASE = 24;
+
+constexpr int materialMg[7] = {0, 82, 337, 365, 477, 1025, 0};
+constexpr int materialEg[7] = {0, 94, 281, 297, 512, 936, 0};
+
+// Piece-square tables from White's point of view, laid out a8..h8 on the first row down to a1..h1
+constexpr int pstMg[7][64] = {
+    {},
+    {     0,   0,   0,   0,   0,   0,   0,   0,
+         98, 134,  61,  95,  68, 126,  34, -11,
+         -6,   7,  26,  31,  65,  56,  25, -20,
+        -14,  13,   6,  21,  23,  12,  17, -23,
+        -27,  -2,  -5,  12,  17,   6,  10, -25,
+        -26,  -4,  -4, -10,   3,   3,  33, -12,
+        -35,  -1, -20, -23, -15,  24,  38, -22,
+          0,   0,   0,   0,   0,   0,   0,   0 },
+    {  -167, -89, -34, -49,  61, -97, -15,-107,
+        -73, -41,  72,  36,  23,  62,   7, -17,
+        -47,  60,  37,  65,  84, 129,  73,  44,
+         -9,  17,  19,  53,  37,  69,  18,  22,
+        -13,   4,  16,  13,  28,  19,  21,  -8,
+        -23,  -9,  12,  10,  19,  17,  25, -16,
+        -29, -53, -12,  -3,  -1,  18, -14, -19,
+       -105, -21, -58, -33, -17, -28, -19, -23 },
+    {   -29,   4, -82, -37, -25, -42,   7,  -8,
+        -26,  16, -18, -13,  30,  59,  18, -47,
+        -16,  37,  43,  40,  35,  50,  37,  -2,
+         -4,   5,  19,  50,  37,  37,   7,  -2,
+         -6,  13,  13,  26,  34,  12,  10,   4,
+          0,  15,  15,  15,  14,  27,  18,  10,
+          4,  15,  16,   0,   7,  21,  33,   1,
+        -33,  -3, -14, -21, -13, -12, -39, -21 },
+    {    32,  42,  32,  51,  63,   9,  31,  43,
+         27,  32,  58,  62,  80,  67,  26,  44,
+         -5,  19,  26,  36,  17,  45,  61,  16,
+        -24, -11,   7,  26,  24,  35,  -8, -20,
+        -36, -26, -12,  -1,   9,  -7,   6, -23,
+        -45, -25, -16, -17,   3,   0,  -5, -33,
+        -44, -16, -20,  -9,  -1,  11,  -6, -71,
+        -19, -13,   1,  17,  16,   7, -37, -26 },
+    {   -28,   0,  29,  12,  59,  44,  43,  45,
+        -24, -39,  -5,   1, -16,  57,  28,  54,
+        -13, -17,   7,   8,  29,  56,  47,  57,
+        -27, -27, -16, -16,  -1,  17,  -2,   1,
+         -9, -26,  -9, -10,  -2,  -4,   3,  -3,
+        -14,   2, -11,  -2,  -5,   2,  14,   5,
+        -35,  -8,  11,   2,   8,  15,  -3,   1,
+         -1, -18,  -9,  10, -15, -25, -31, -50 },
+    {   -65,  23,  16, -15, -56, -34,   2,  13,
+         29,  -1, -20,  -7,  -8,  -4, -38, -29,
+         -9,  24,   2, -16, -20,   6,  22, -22,
+        -17, -20, -12, -27, -30, -25, -14, -36,
+        -49,  -1, -27, -39, -46, -44, -33, -51,
+        -14, -14, -22, -46, -44, -30, -15, -27,
+          1,   7,  -8, -64, -43, -16,   9,   8,
+        -15,  36,  12, -54,   8, -28,  24,  14 },
+};
+
+constexpr int pstEg[7][64] = {
+    {},
+    {     0,   0,   0,   0,   0,   0,   0,   0,
+        178, 173, 158, 134, 147, 132, 165, 187,
+         94, 100,  85,  67,  56,  53,  82,  84,
+         32,  24,  13,   5,  -2,   4,  17,  17,
+         13,   9,  -3,  -7,  -7,  -8,   3,  -1,
+          4,   7,  -6,   1,   0,  -5,  -1,  -8,
+         13,   8,   8,  10,  13,   0,   2,  -7,
+          0,   0,   0,   0,   0,   0,   0,   0 },
+    {   -58, -38, -13, -28, -31, -27, -63, -99,
+        -25,  -8, -25,  -2,  -9, -25, -24, -52,
+        -24, -20,  10,   9,  -1,  -9, -19, -41,
+        -17,   3,  22,  22,  22,  11,   8, -18,
+        -18,  -6,  16,  25,  16,  17,   4, -18,
+        -23,  -3,  -1,  15,  10,  -3, -20, -22,
+        -42, -20, -10,  -5,  -2, -20, -23, -44,
+        -29, -51, -23, -15, -22, -18, -50, -64 },
+    {   -14, -21, -11,  -8,  -7,  -9, -17, -24,
+         -8,  -4,   7, -12,  -3, -13,  -4, -14,
+          2,  -8,   0,  -1,  -2,   6,   0,   4,
+         -3,   9,  12,   9,  14,  10,   3,   2,
+         -6,   3,  13,  19,   7,  10,  -3,  -9,
+        -12,  -3,   8,  10,  13,   3,  -7, -15,
+        -14, -18,  -7,  -1,   4,  -9, -15, -27,
+        -23,  -9, -23,  -5,  -9, -16,  -5, -17 },
+    {    13,  10,  18,  15,  12,  12,   8,   5,
+         11,  13,  13,  11,  -3,   3,   8,   3,
+          7,   7,   7,   5,   4,  -3,  -5,  -3,
+          4,   3,  13,   1,   2,   1,  -1,   2,
+          3,   5,   8,   4,  -5,  -6,  -8, -11,
+         -4,   0,  -5,  -1,  -7, -12,  -8, -16,
+         -6,  -6,   0,   2,  -9,  -9, -11,  -3,
+         -9,   2,   3,  -1,  -5, -13,   4, -20 },
+    {    -9,  22,  22,  27,  27,  19,  10,  20,
+        -17,  20,  32,  41,  58,  25,  30,   0,
+        -20,   6,   9,  49,  47,  35,  19,   9,
+          3,  22,  24,  45,  57,  40,  57,  36,
+        -18,  28,  19,  47,  31,  34,  39,  23,
+        -16, -27,  15,   6,   9,  17,  10,   5,
+        -22, -23, -30, -16, -16, -23, -36, -32,
+        -33, -28, -22, -43,  -5, -32, -20, -41 },
+    {   -74, -35, -18, -18, -11,  15,   4, -17,
+        -12,  17,  14,  17,  17,  38,  23,  11,
+         10,  17,  23,  15,  20,  45,  44,  13,
+         -8,  22,  24,  27,  26,  33,  26,   3,
+        -18,  -4,  21,  24,  27,  23,   9, -11,
+        -19,  -3,  11,  21,  23,  16,   7,  -9,
+        -27, -11,   4,  13,  14,   4,  -5, -17,
+        -53, -34, -21, -11, -28, -14, -24, -43 },
+};
+
+// Material plus piece-square value by [color][piece][square], black entries mirrored and negated
+// so the board's running sum is always from White's point of view
+int pieceSquare[2][7][64];
+
+void InitEval() {
+    for (int piece = PAWN; piece <= KING; piece++) {
+        for (int sq = 0; sq < 64; sq++) {
+            pieceSquare[WHITE][piece][sq] = S(materialMg[piece] + pstMg[piece][sq ^ 56], materialEg[piece] + pstEg[piece][sq ^ 56]);
+            pieceSquare[BLACK][piece][sq] = -S(materialMg[piece] + pstMg[piece][sq], materialEg[piece] + pstEg[piece][sq]);
+        }
+    }
+}
+
+// Optional neural evaluation: (768 -> NNUE_HIDDEN) x 2 -> 1 with clipped ReLU. Inputs are (own/enemy, piece, square)
+// from each side's perspective, mirrored horizontally while that side's king stands on files e-h
+constexpr int NNUE_INPUTS = 768;
+constexpr int NNUE_HIDDEN = 256;
+constexpr int NNUE_QA = 255; // feature transformer quantization, also the clipped ReLU ceiling
+constexpr int NNUE_QB = 64; // output layer quantization
+constexpr int NNUE_SCALE = 400; // network output to centipawns
+
+struct NnueNetwork {
+    alignas(64) int16_t featureWeights[NNUE_INPUTS][NNUE_HIDDEN];
+    alignas(64) int16_t featureBias[NNUE_HIDDEN];
+    alignas(64) int16_t outputWeights[2 * NNUE_HIDDEN]; // side to move half first
+    int16_t outputBias;
+};
+
+unique_ptr<NnueNetwork> nnueNet; // null until EvalFile loads a network
+uint32_t nnueEpoch = 0; // bumped on every load, accumulators computed under another epoch are stale
+bool useNnue = true;
+
+// Hidden layer of one position, per perspective, computed lazily when the position is evaluated
+struct NnueAccumulator {
+    alignas(64) int16_t values[2][NNUE_HIDDEN];
+    uint32_t epoch[2];
+};
+
+// Last refresh of one perspective and mirror bucket, later refreshes only add the pieces that changed since
+struct NnueRefreshEntry {
+    alignas(64) int16_t values[NNUE_HIDDEN];
+    uint64_t pieces[2][6];
+    uint32_t epoch;
+};
+
+// Engine statistics: per-thread counters and sampled latency histograms. They are read as deltas around a
+// search or a command and summed per game and engine-wide, so the hot paths never synchronize or print.
+// Define NEPTUNE_NO_STATS to compile the counting out
+#ifndef NEPTUNE_NO_STATS
+#define USE_STATS
+#endif
+
+enum StatPhase {
+    PHASE_MOVEGEN, PHASE_MAKE, PHASE_UNMAKE, PHASE_EVAL, PHASE_SETUP, PHASE_NB
+};
+
+const char* const phaseNames[PHASE_NB] = {"movegen", "make", "unmake", "eval", "setup"};
+
+// One call in sampleMask + 1 is timed, so reading the clock stays a small share of short calls
+constexpr uint64_t sampleMask[PHASE_NB] = {63, 63, 63, 63, 0};
+
+constexpr int CUTOFF_SLOTS = 8; // beta cutoffs by index of the cutting move, the last slot counts all later moves
+constexpr int LATENCY_BUCKETS = 40; // bucket b counts samples of 2^b to 2^(b+1) - 1 ticks
+
+struct EngineStats {
+    uint64_t nodes = 0; // full-width nodes
+    uint64_t qnodes = 0;
+    uint64_t ttProbes = 0;
+    uint64_t ttHits = 0;
+    uint64_t cutoffs[CUTOFF_SLOTS] = {};
+    uint64_t calls[PHASE_NB] = {};
+    uint64_t latency[PHASE_NB][LATENCY_BUCKETS] = {};
+
+    // Every field is a uint64_t counter, so the struct adds and subtracts as one array
+    static constexpr size_t FIELDS = 4 + CUTOFF_SLOTS + PHASE_NB + PHASE_NB * LATENCY_BUCKETS;
+
+    EngineStats& operator+=(const EngineStats& other) {
+        uint64_t* dst = &nodes;
+        const uint64_t* src = &other.nodes;
+        for (size_t i = 0; i < FIELDS; i++) dst[i] += src[i];
+        return *this;
+    }
+
+    EngineStats operator-(const EngineStats& other) const {
+        EngineStats result = *this;
+        uint64_t* dst = &result.nodes;
+        const uint64_t* src = &other.nodes;
+        for (size_t i = 0; i < FIELDS; i++) dst[i] -= src[i];
+        return result;
+    }
+};
+static_assert(sizeof(EngineStats) == EngineStats::FIELDS * sizeof(uint64_t), "EngineStats must hold only counters");
+
+thread_local EngineStats threadStats;
+
+// Time stamp counter ticks where there is one, steady clock nanoseconds elsewhere
+inline uint64_t ReadTicks() {
+#ifdef __x86_64__
+    return __rdtsc();
+#else
+    return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Counts a call of the phase and, if it is a sampled one, times the enclosing scope into its histogram
+class PhaseTimer {
 public:
-    uint64_t whitePawns, whiteKnights, whiteBishops, whiteRooks, whiteQueens, whiteKing;
-    uint64_t blackPawns, blackKnights, blackBishops, blackRooks, blackQueens, blackKing;
+    explicit PhaseTimer(StatPhase phase) : phase(phase) {
+        start = (threadStats.calls[phase]++ & sampleMask[phase]) == 0 ? ReadTicks() : 0;
+    }
+
+    ~PhaseTimer() {
+        if (!start) return;
+        uint64_t ticks = ReadTicks() - start;
+        threadStats.latency[phase][min(63 - __builtin_clzll(ticks | 1), LATENCY_BUCKETS - 1)]++;
+    }
+
+private:
+    StatPhase phase;
+    uint64_t start;
+};
+
+#ifdef USE_STATS
+#define STAT_COUNT(counter) (threadStats.counter++)
+#define STAT_TIME(phase) PhaseTimer phaseTimer(phase)
+#else
+#define STAT_COUNT(counter) ((void)0)
+#define STAT_TIME(phase) ((void)0)
+#endif
+
+// Everything make_move cannot recover from the position it leaves behind
+struct UndoInfo {
+    Move move;
+    uint8_t movedPiece;
+    uint8_t capturedPiece;
+    uint8_t castlingRights;
+    uint8_t enPassantSquare;
+    uint8_t halfmoveClock;
+    uint8_t phase;
+    int32_t psqt;
+    uint64_t zobristKey;
+    uint64_t attacks[2];
+};
+
+constexpr int MAX_PLY = 1024;
 
-    uint64_t whitePieces;
-    uint64_t blackPieces;
+class Board {
+public:
+    uint64_t pieces[2][6]; // [color][piece - PAWN]
+    uint64_t occupancy[2]; // all pieces of each color
     uint64_t allPieces;
 
-    uint8_t whiteKingPos;
-    uint8_t blackKingPos;
+    uint64_t attacks[2]; // every square each color attacks
 
-    uint64_t whiteAttacks;
-    uint64_t blackAttacks;
+    uint64_t zobristKey = 0ULL; //Zobrist Hash, set by setBB and kept up to date by make_move/unmake_move
+    int psqt = 0; // packed material + piece-square score from White's view, kept up to date like the key
+
+    uint8_t mailbox[64]; // MakePiece(color, piece) on each square, 0 when empty
+    uint8_t kingSq[2];
 
     bool whiteToMove;
 
@@ -221,12 +959,34 @@ public:
     uint8_t halfmoveClock; //Used for 50-move rule
     uint8_t fullmoveNumber; //Counts the move number
 
-    uint64_t zobristKey = 0ULL; //Zobrist Hash !!Don't use this, this feature is not yet implemented!!
+    uint8_t phase = 0; // sum of phaseWeight over the pieces on the board
+
+    vector<UndoInfo> history; // one record per move made, popped by unmake_move. Also the game's key history for repetitions
+
+    // NNUE hidden layers by ply (history.size()), filled in by the evaluation rather than by make_move
+    mutable vector<NnueAccumulator> nnueStack;
+    mutable NnueRefreshEntry nnueRefresh[2][2]; // [perspective][mirrored]
+
+    uint64_t& bitboard(int color, Piece piece) {
+        return pieces[color][piece - PAWN];
+    }
+
+    uint64_t bitboard(int color, Piece piece) const {
+        return pieces[color][piece - PAWN];
+    }
+
+    Piece pieceOn(int sq) const {
+        return PieceType(mailbox[sq]);
+    }
 
-    Piece pieceAt[64];
+    // Meaningless on an empty square
+    Color colorOn(int sq) const {
+        return PieceColor(mailbox[sq]);
+    }
 
     void setBB(const string& fen) {
         if (fen.length() == 0) return;
+        STAT_TIME(PHASE_SETUP);
         istringstream fss(fen);
         string field;
         vector<string> fields;
@@ -271,125 +1031,121 @@ public:
         halfmoveClock = std::stoi(fields[4]);
         fullmoveNumber = std::stoi(fields[5]);
 
-        UpdateOccupancy();
-        UpdateAttacks();
-    }
-
-    void UpdateAttacks() {
-        whiteAttacks = 0ULL;
-        blackAttacks = 0ULL;
-
-        AddNonSlidingAttacks(whiteKnights, KNIGHT, WHITE, whiteAttacks);
-        AddNonSlidingAttacks(whiteKing, KING, WHITE, whiteAttacks);
-        AddNonSlidingAttacks(whitePawns, PAWN, WHITE, whiteAttacks);
-        AddNonSlidingAttacks(blackKnights, KNIGHT, BLACK, blackAttacks);
-        AddNonSlidingAttacks(blackKing, KING, BLACK, blackAttacks);
-        AddNonSlidingAttacks(blackPawns, PAWN, BLACK, blackAttacks);
-
-        AddSlidingAttacks(whiteBishops, BISHOP, WHITE, whiteAttacks);
-        AddSlidingAttacks(whiteRooks, ROOK, WHITE, whiteAttacks);
-        AddSlidingAttacks(whiteQueens, QUEEN, WHITE, whiteAttacks);
-        AddSlidingAttacks(blackBishops, BISHOP, BLACK, blackAttacks);
-        AddSlidingAttacks(blackRooks, ROOK, BLACK, blackAttacks);
-        AddSlidingAttacks(blackQueens, QUEEN, BLACK, blackAttacks);
-    }
-    void AddSlidingAttacks(uint64_t pieces, Piece pieceType, Color color, uint64_t& attacks) {
-        if (pieceType == KNIGHT || pieceType == KING || pieceType == PAWN) return;
-        if (pieceType == QUEEN) {
-            AddSlidingAttacks(pieces, ROOK, color, attacks);
-            AddSlidingAttacks(pieces, BISHOP, color, attacks);
-            return;
-        }
-        uint64_t p = pieces;
-        while(p) {
-            int sq = __builtin_ctzll(p);
-            p &= p - 1;
+        ResetState();
+    }
 
-            switch (pieceType) {
-                case BISHOP: {
-                    attacks |= CalculateSlidingAttacks(sq, bishopDirs, allPieces);
-                    break;
-                }
-                case ROOK: {
-                    attacks |= CalculateSlidingAttacks(sq, rookDirs, allPieces);
-                    break;
-                }
-            }
+    // Position from a piece list with no castling rights or en passant square. The bitbase generator sets up
+    // millions of positions this way, a FEN round trip per position would dominate its run time
+    void setPieces(const int colors[], const Piece types[], const int squares[], int count, bool whiteMoves) {
+        memset(pieces, 0, sizeof(pieces));
+        memset(mailbox, 0, sizeof(mailbox));
+        for (int i = 0; i < count; i++) {
+            bitboard(colors[i], types[i]) |= bitMasks[squares[i]];
+            mailbox[squares[i]] = MakePiece(colors[i], types[i]);
         }
+        whiteToMove = whiteMoves;
+        castlingRights = 0;
+        enPassantSquare = 0;
+        halfmoveClock = 0;
+        fullmoveNumber = 1;
+        ResetState();
+    }
+
+    // Empty move history and everything derived from the pieces, after they were placed
+    void ResetState() {
+        history.clear();
+        history.reserve(MAX_PLY);
+        nnueStack.assign(1, NnueAccumulator{});
+        for (auto& perspective : nnueRefresh)
+            for (NnueRefreshEntry& entry : perspective) entry.epoch = 0;
+
+        UpdateOccupancy();
+        CollectAttacks();
+        zobristKey = ComputeZobrist();
+        ComputePsqt(psqt, phase);
     }
 
-    uint64_t CalculateSlidingAttacks(uint64_t sq, const int directions[][2], uint64_t all) {
-        int rank = sq >> 3;
-        int file = sq & 7;
-        uint64_t attacks = 0;
+    // Material, piece-square sum and phase from scratch, make_move maintains them incrementally
+    void ComputePsqt(int& score, uint8_t& gamePhase) const {
+        score = 0;
+        gamePhase = 0;
+        for (int sq = 0; sq < 64; sq++) {
+            if (!mailbox[sq]) continue;
+            score += pieceSquare[colorOn(sq)][pieceOn(sq)][sq];
+            gamePhase += phaseWeight[pieceOn(sq)];
+        }
+    }
 
-        for (int d = 0; d < 4; d++) {
-            int r = rank + directions[d][0];
-            int f = file + directions[d][1];
-            while (r >= 0 && r < 8 && f >= 0 && f < 8) {
-                int target = r * 8 + f;
-                uint64_t targetBB = bitMasks[target];
-                attacks |= targetBB;
-                if (all & targetBB) break;
-                r += directions[d][0];
-                f += directions[d][1];
-            }           
+    // Hash of the whole position from scratch. make_move keeps zobristKey equal to this incrementally
+    uint64_t ComputeZobrist() const {
+        uint64_t key = 0;
+        for (int sq = 0; sq < 64; sq++) {
+            if (mailbox[sq]) key ^= zobristPieces[colorOn(sq)][pieceOn(sq)][sq];
         }
-        return attacks;
+        key ^= zobristCastling[castlingRights];
+        if (hasEnPassant()) key ^= zobristEnPassant[getEnPassantTarget() & 7];
+        if (!whiteToMove) key ^= zobristSide;
+        return key;
     }
 
-    void AddNonSlidingAttacks(uint64_t pieces, Piece pieceType, Color color, uint64_t& attacks) {
-        if (pieceType == BISHOP || pieceType == ROOK || pieceType == QUEEN) return;
-        uint64_t p = pieces;
-        while(p) {
-            int sq = __builtin_ctzll(p);
-            p &= p - 1;
+    // Whole-side attack maps: pawns, knights and king are shifted set-wise and all sliders of a side
+    // are filled at once, so make_move pays the same whatever the number of pieces
+    template<Color Us>
+    uint64_t SideAttacks() const {
+        uint64_t queens = bitboard(Us, QUEEN);
+        return PawnAttacksSetwise(bitboard(Us, PAWN), Us)
+             | KnightAttacksSetwise(bitboard(Us, KNIGHT))
+             | KingAttacksSetwise(bitboard(Us, KING))
+             | SliderAttacksSetwise(bitboard(Us, BISHOP) | queens, bitboard(Us, ROOK) | queens, allPieces);
+    }
 
-            switch (pieceType) {
-                case KNIGHT: attacks |= knightAttacks[sq]; break;
-                case KING: attacks |= kingAttacks[sq]; break;
-                case PAWN: attacks |= pawnAttacks[color][sq]; break;
+    // Square by square from the lookup tables, the reference the set-wise maps are checked against
+    uint64_t ComputeAttacks(Color color) const {
+        uint64_t result = 0;
+        for (uint64_t p = occupancy[color]; p; p &= p - 1) {
+            int sq = __builtin_ctzll(p);
+            switch (pieceOn(sq)) {
+                case PAWN: result |= pawnAttacks[color][sq]; break;
+                case KNIGHT: result |= knightAttacks[sq]; break;
+                case BISHOP: result |= BishopAttacks(sq, allPieces); break;
+                case ROOK: result |= RookAttacks(sq, allPieces); break;
+                case QUEEN: result |= QueenAttacks(sq, allPieces); break;
+                default: result |= kingAttacks[sq]; break;
             }
         }
+        return result;
+    }
+
+    void CollectAttacks() {
+        attacks[WHITE] = SideAttacks<WHITE>();
+        attacks[BLACK] = SideAttacks<BLACK>();
     }
 
     void ParsePieces(string piecesField) {
         vector<string> ranks;
-        size_t start = 0;
         stringstream ss(piecesField);
         string rank;
         while (getline(ss, rank, '/')) ranks.push_back(rank);
 
-        whitePawns = whiteKnights = whiteBishops = whiteRooks = whiteQueens = whiteKing = 0ULL;
-        blackPawns = blackKnights = blackBishops = blackRooks = blackQueens = blackKing = 0ULL;
+        memset(pieces, 0, sizeof(pieces));
+        memset(mailbox, 0, sizeof(mailbox));
 
         for (uint8_t i = 0; i < 8 ; i++) {
             uint8_t file = 0;
             for (uint8_t j = 0; j < ranks[i].length(); j++) {
                 char piece = ranks[i][j];
                 if (isdigit(piece)) {
-                    for (int k = 0; k < (piece - '0'); k++) {
-                        pieceAt[(7-i)*8 + file] = EMPTY;
-                        file++;
-                    }
+                    file += piece - '0';
                     continue;
                 }
                 uint8_t squareIndex = (7-i)*8 + file; // Board square index: a1 = 0, h8 = 63 (bottom-left to top-right)
-                switch (piece) {
-                        case 'P': whitePawns     |= bitMasks[squareIndex]; pieceAt[squareIndex] = PAWN;   break;
-                        case 'N': whiteKnights   |= bitMasks[squareIndex]; pieceAt[squareIndex] = KNIGHT; break;
-                        case 'B': whiteBishops   |= bitMasks[squareIndex]; pieceAt[squareIndex] = BISHOP; break;
-                        case 'R': whiteRooks     |= bitMasks[squareIndex]; pieceAt[squareIndex] = ROOK;   break;
-                        case 'Q': whiteQueens    |= bitMasks[squareIndex]; pieceAt[squareIndex] = QUEEN;  break;
-                        case 'K': whiteKing      |= bitMasks[squareIndex]; pieceAt[squareIndex] = KING;   break;
-
-                        case 'p': blackPawns     |= bitMasks[squareIndex]; pieceAt[squareIndex] = PAWN;   break;
-                        case 'n': blackKnights   |= bitMasks[squareIndex]; pieceAt[squareIndex] = KNIGHT; break;
-                        case 'b': blackBishops   |= bitMasks[squareIndex]; pieceAt[squareIndex] = BISHOP; break;
-                        case 'r': blackRooks     |= bitMasks[squareIndex]; pieceAt[squareIndex] = ROOK;   break;
-                        case 'q': blackQueens    |= bitMasks[squareIndex]; pieceAt[squareIndex] = QUEEN;  break;
-                        case 'k': blackKing      |= bitMasks[squareIndex]; pieceAt[squareIndex] = KING;   break;
-                        default: cerr << "[WARNING]: Unknown piece character '" << piece << "'\n"; break;
+                Piece type = charToPiece(piece);
+                if (type == EMPTY) {
+                    cerr << "[WARNING]: Unknown piece character '" << piece << "'\n";
+                } else {
+                    int color = isupper(piece) ? WHITE : BLACK;
+                    bitboard(color, type) |= bitMasks[squareIndex];
+                    mailbox[squareIndex] = MakePiece(color, type);
                 }
                 file++;
             }
@@ -397,106 +1153,214 @@ public:
     }
 
     void make_move(Move move) {
-        int from = move.from;
-        int to = move.to;
-        bool isWhite = whiteToMove;
+        STAT_TIME(PHASE_MAKE);
+        if (whiteToMove) MakeMove<WHITE>(move);
+        else MakeMove<BLACK>(move);
+    }
+
+    // Reverts the last make_move exactly, using the record it pushed
+    void unmake_move() {
+        STAT_TIME(PHASE_UNMAKE);
+        if (whiteToMove) UnmakeMove<BLACK>();
+        else UnmakeMove<WHITE>();
+    }
+
+    template<Color Us>
+    void MakeMove(Move move) {
+        constexpr Color Them = ~Us;
+        constexpr int Up = Us == WHITE ? 8 : -8;
+        constexpr uint64_t DoublePushRank = Us == WHITE ? rank4 : rank5;
+        constexpr uint64_t StartRank = Us == WHITE ? rank2 : rank7;
+
+        int from = move.from();
+        int to = move.to();
         uint64_t fromBB = bitMasks[from];
         uint64_t toBB = bitMasks[to];
-        enPassantSquare = 0;
-        halfmoveClock++;
-        Piece movedPiece = pieceAt[from];
-        Piece capturedPiece = pieceAt[to];
-        pieceAt[to] = movedPiece;
+        Piece movedPiece = pieceOn(from);
+        Piece capturedPiece = pieceOn(to);
 
-        uint64_t* bitboards[2][6] = {
-            { &whitePawns, &whiteKnights, &whiteBishops, &whiteRooks, &whiteQueens, &whiteKing },
-            { &blackPawns, &blackKnights, &blackBishops, &blackRooks, &blackQueens, &blackKing }
-        };
+        history.push_back({move, (uint8_t)movedPiece, (uint8_t)capturedPiece, castlingRights, enPassantSquare, halfmoveClock, phase,
+                           psqt, zobristKey, {attacks[WHITE], attacks[BLACK]}});
+
+        uint64_t key = zobristKey ^ zobristSide ^ zobristCastling[castlingRights];
+        if (hasEnPassant()) key ^= zobristEnPassant[getEnPassantTarget() & 7];
+        key ^= zobristPieces[Us][movedPiece][from] ^ zobristPieces[Us][movedPiece][to];
+        key ^= zobristPieces[Them][capturedPiece][to];
+        psqt += pieceSquare[Us][movedPiece][to] - pieceSquare[Us][movedPiece][from] - pieceSquare[Them][capturedPiece][to];
+        phase -= phaseWeight[capturedPiece];
 
-        Color mySide = isWhite ? WHITE : BLACK;
+        enPassantSquare = 0;
+        halfmoveClock++;
+        if (capturedPiece != EMPTY) {
+            bitboard(Them, capturedPiece) &= ~toBB;
+            halfmoveClock = 0;
+        }
+        bitboard(Us, movedPiece) ^= fromBB | toBB;
+        mailbox[to] = mailbox[from];
+        mailbox[from] = 0;
 
         if (movedPiece == PAWN) {
-            *bitboards[mySide][0] &= ~fromBB;
-            *bitboards[mySide][0] |= toBB;
             halfmoveClock = 0;
-            if (move.isEnPassant) {
-                int capSq = isWhite ? to - 8 : to + 8;
-                *bitboards[!isWhite][0] &= ~bitMasks[capSq];
-                pieceAt[capSq] = EMPTY;
+            if (move.isEnPassant()) {
+                int capSq = to - Up;
+                bitboard(Them, PAWN) &= ~bitMasks[capSq];
+                mailbox[capSq] = 0;
+                key ^= zobristPieces[Them][PAWN][capSq];
+                psqt -= pieceSquare[Them][PAWN][capSq];
             }
-            if ((fromBB & rank2) && (toBB & rank4)) {
-                enPassantSquare = (1 << 6) | (from + 8);
+            if ((fromBB & StartRank) && (toBB & DoublePushRank)) {
+                enPassantSquare = (1 << 6) | (from + Up);
+                key ^= zobristEnPassant[from & 7];
             }
-            if (move.promotion != 0) {
-                *bitboards[mySide][0] &= ~toBB;
-                Piece promoted = charToPiece(move.promotion);
-                *bitboards[mySide][promoted-1] |= toBB;
-                pieceAt[to] = promoted;
+            if (move.isPromotion()) {
+                Piece promoted = move.promotion();
+                bitboard(Us, PAWN) &= ~toBB;
+                bitboard(Us, promoted) |= toBB;
+                mailbox[to] = MakePiece(Us, promoted);
+                key ^= zobristPieces[Us][PAWN][to] ^ zobristPieces[Us][promoted][to];
+                psqt += pieceSquare[Us][promoted][to] - pieceSquare[Us][PAWN][to];
+                phase += phaseWeight[promoted];
             }
         } else if (movedPiece == KING) {
-            *bitboards[mySide][5] &= ~fromBB;
-            *bitboards[mySide][5] |= toBB;
-            if (mySide == WHITE) whiteKingPos = to;
-            else blackKingPos = to;
-
-            if (from == e1 || from == e8) {
-                castlingRights &= ~(3 << (2*(1-mySide)));
-                if (to == g1) {
-                    whiteRooks = (whiteRooks & ~bitMasks[h1]) | bitMasks[f1];
-                    pieceAt[h1] = EMPTY;
-                    pieceAt[f1] = ROOK;
-                } else if (to == c1) {
-                    whiteRooks = (whiteRooks & ~bitMasks[a1]) | bitMasks[d1];
-                    pieceAt[a1] = EMPTY;
-                    pieceAt[d1] = ROOK;
-                } else if (to == g8) {
-                    blackRooks = (blackRooks & ~bitMasks[h8]) | bitMasks[f8];
-                    pieceAt[h8] = EMPTY;
-                    pieceAt[f8] = ROOK;
-                } else if (to == c8) {
-                    blackRooks = (blackRooks & ~bitMasks[a8]) | bitMasks[d8];
-                    pieceAt[a8] = EMPTY;
-                    pieceAt[d8] = ROOK;
-                }
+            castlingRights &= Us == WHITE ? 0b0011 : 0b1100;
+            if (move.isCastling()) {
+                bool kingside = to > from;
+                int rookFrom = kingside ? to + 1 : to - 2;
+                int rookTo = kingside ? to - 1 : to + 1;
+                bitboard(Us, ROOK) ^= bitMasks[rookFrom] | bitMasks[rookTo];
+                mailbox[rookFrom] = 0;
+                mailbox[rookTo] = MakePiece(Us, ROOK);
+                key ^= zobristPieces[Us][ROOK][rookFrom] ^ zobristPieces[Us][ROOK][rookTo];
+                psqt += pieceSquare[Us][ROOK][rookTo] - pieceSquare[Us][ROOK][rookFrom];
             }
-
-        } else {
-            *bitboards[mySide][movedPiece-1] &= ~fromBB;
-            *bitboards[mySide][movedPiece-1] |= toBB;
         }
 
         castlingRights &= ~(castlingClearTable[from] | castlingClearTable[to]);
+        key ^= zobristCastling[castlingRights];
 
-        if (capturedPiece != EMPTY) {
-            *bitboards[1-mySide][capturedPiece-1] &= ~toBB;
-            halfmoveClock = 0;
+        whiteToMove = !whiteToMove;
+        if (Us == BLACK) fullmoveNumber++;
+
+        zobristKey = key;
+        TT.prefetch(key);
+        if (nnueNet) {
+            if (nnueStack.size() <= history.size()) nnueStack.resize(history.size() + 1);
+            nnueStack[history.size()].epoch[WHITE] = nnueStack[history.size()].epoch[BLACK] = 0;
+        }
+
+        UpdateOccupancy();
+        CollectAttacks();
+
+#ifdef NEPTUNE_DEBUG
+        if (zobristKey != ComputeZobrist()) {
+            cerr << "[ERROR] Incremental Zobrist key diverged after " << indexToSquare(from) << indexToSquare(to) << "\n";
+            abort();
+        }
+        int fullPsqt;
+        uint8_t fullPhase;
+        ComputePsqt(fullPsqt, fullPhase);
+        if (psqt != fullPsqt || phase != fullPhase) {
+            cerr << "[ERROR] Incremental evaluation diverged after " << indexToSquare(from) << indexToSquare(to) << "\n";
+            abort();
+        }
+        if (attacks[WHITE] != ComputeAttacks(WHITE) || attacks[BLACK] != ComputeAttacks(BLACK)) {
+            cerr << "[ERROR] Set-wise attack map diverged after " << indexToSquare(from) << indexToSquare(to) << "\n";
+            abort();
         }
+#endif
+    }
+
+    // Us is the side that made the move being taken back
+    template<Color Us>
+    void UnmakeMove() {
+        constexpr Color Them = ~Us;
+        constexpr int Up = Us == WHITE ? 8 : -8;
 
-        pieceAt[from] = EMPTY;
+        const UndoInfo& undo = history.back();
+        Move move = undo.move;
+        int from = move.from();
+        int to = move.to();
+        uint64_t fromBB = bitMasks[from];
+        uint64_t toBB = bitMasks[to];
 
         whiteToMove = !whiteToMove;
-        if (!whiteToMove) fullmoveNumber++;
+        if (Us == BLACK) fullmoveNumber--;
+
+        Piece movedPiece = (Piece)undo.movedPiece;
+        bitboard(Us, pieceOn(to)) &= ~toBB;
+        bitboard(Us, movedPiece) |= fromBB;
+        mailbox[from] = MakePiece(Us, movedPiece);
+        mailbox[to] = 0;
+
+        if (undo.capturedPiece != EMPTY) {
+            bitboard(Them, (Piece)undo.capturedPiece) |= toBB;
+            mailbox[to] = MakePiece(Them, (Piece)undo.capturedPiece);
+        }
+
+        if (move.isEnPassant()) {
+            int capSq = to - Up;
+            bitboard(Them, PAWN) |= bitMasks[capSq];
+            mailbox[capSq] = MakePiece(Them, PAWN);
+        }
+
+        if (move.isCastling()) {
+            bool kingside = to > from;
+            int rookFrom = kingside ? to + 1 : to - 2;
+            int rookTo = kingside ? to - 1 : to + 1;
+            bitboard(Us, ROOK) ^= bitMasks[rookFrom] | bitMasks[rookTo];
+            mailbox[rookTo] = 0;
+            mailbox[rookFrom] = MakePiece(Us, ROOK);
+        }
+
+        castlingRights = undo.castlingRights;
+        enPassantSquare = undo.enPassantSquare;
+        halfmoveClock = undo.halfmoveClock;
+        zobristKey = undo.zobristKey;
+        psqt = undo.psqt;
+        phase = undo.phase;
+        attacks[WHITE] = undo.attacks[WHITE];
+        attacks[BLACK] = undo.attacks[BLACK];
 
+        history.pop_back();
         UpdateOccupancy();
-        UpdateAttacks();
     }
 
+    // True if the current position already occurred with the same side to move.
+    // Only the last halfmoveClock plies can match, a capture or pawn move in between is irreversible
+    bool IsRepetition() const {
+        int n = history.size();
+        int stop = max(0, n - (int)halfmoveClock);
+        for (int i = n - 4; i >= stop; i -= 2) {
+            if (history[i].zobristKey == zobristKey) return true;
+        }
+        return false;
+    }
 
-
-    bool is_king_in_check(bool white) {
-        return white ? (blackAttacks & bitMasks[whiteKingPos]) != 0
-                    : (whiteAttacks & bitMasks[blackKingPos]) != 0;
+    // Counts earlier occurrences, a threefold repetition has two
+    int RepetitionCount() const {
+        int n = history.size(), count = 0;
+        int stop = max(0, n - (int)halfmoveClock);
+        for (int i = n - 4; i >= stop; i -= 2) {
+            if (history[i].zobristKey == zobristKey) count++;
+        }
+        return count;
     }
 
+    bool IsFiftyMoveDraw() const {
+        return halfmoveClock >= 100;
+    }
 
+    bool is_king_in_check(bool white) const {
+        Color us = white ? WHITE : BLACK;
+        return (attacks[~us] & bitMasks[kingSq[us]]) != 0;
+    }
 
     void UpdateOccupancy() {
-        whitePieces = whitePawns | whiteKnights | whiteBishops | whiteRooks | whiteQueens | whiteKing;
-        blackPieces = blackPawns | blackKnights | blackBishops | blackRooks | blackQueens | blackKing;
-        allPieces = whitePieces | blackPieces;
-
-        whiteKingPos = __builtin_ctzll(whiteKing);
-        blackKingPos = __builtin_ctzll(blackKing);
+        for (int color = 0; color < 2; color++) {
+            occupancy[color] = pieces[color][0] | pieces[color][1] | pieces[color][2] | pieces[color][3] | pieces[color][4] | pieces[color][5];
+            kingSq[color] = __builtin_ctzll(pieces[color][KING - PAWN]);
+        }
+        allPieces = occupancy[WHITE] | occupancy[BLACK];
     }
 
     bool hasEnPassant() const {
@@ -510,278 +1374,3862 @@ public:
 
 };
 
-void GenerateCastlingMoves(uint64_t king, uint64_t rooks, uint8_t castlingRights, uint64_t all, vector<Move>& moves, Color color, uint64_t whiteAttacks, uint64_t blackAttacks) {
-    if (color == WHITE) {
-        if (((castlingRights & 0b1000) != 0) && ((all & castlingBB[0]) == 0) && ((blackAttacks & bitMasks[f1]) == 0)) {
-            moves.push_back(Move(e1, g1));
-        }
-        if (((castlingRights & 0b0100) != 0) && ((all & castlingBB[1]) == 0) && ((blackAttacks & bitMasks[d1]) == 0) && ((blackAttacks & bitMasks[c1]) == 0)) {
-            moves.push_back(Move(e1, c1));
-        }
-    } else {
-        if (((castlingRights & 0b0010) != 0) && ((all & castlingBB[2]) == 0) && ((whiteAttacks & bitMasks[f8]) == 0)) {
-            moves.push_back(Move(e8, g8));
-        }
-        if (((castlingRights & 0b0001) != 0) && ((all & castlingBB[3]) == 0) && ((whiteAttacks & bitMasks[d8]) == 0) && ((whiteAttacks & bitMasks[c8]) == 0)) {
-            moves.push_back(Move(e8, c8));
+// Legality data computed once per node: the pieces giving check, the squares a non-king move must
+// land on to resolve it, our pinned pieces, and every square the king may not step to
+struct CheckInfo {
+    int kingSq;
+    uint64_t checkers;
+    uint64_t checkMask;
+    uint64_t pinned;
+    uint64_t danger;
+};
+
+template<Color Us>
+CheckInfo ComputeCheckInfo(const Board& board) {
+    constexpr Color Them = ~Us;
+    CheckInfo ci;
+    ci.kingSq = board.kingSq[Us];
+    uint64_t own = board.occupancy[Us];
+    uint64_t diagonal = board.bitboard(Them, BISHOP) | board.bitboard(Them, QUEEN);
+    uint64_t straight = board.bitboard(Them, ROOK) | board.bitboard(Them, QUEEN);
+
+    uint64_t sliderCheckers = (BishopAttacks(ci.kingSq, board.allPieces) & diagonal)
+                            | (RookAttacks(ci.kingSq, board.allPieces) & straight);
+    ci.checkers = sliderCheckers
+                | (knightAttacks[ci.kingSq] & board.bitboard(Them, KNIGHT))
+                | (pawnAttacks[Us][ci.kingSq] & board.bitboard(Them, PAWN));
+    ci.checkMask = ~0ULL;
+    if (ci.checkers) {
+        int checkerSq = __builtin_ctzll(ci.checkers);
+        ci.checkMask = ci.checkers | betweenBB[ci.kingSq][checkerSq];
+    }
+
+    // The maintained attack map stops at our king; a checking slider also covers the squares behind it
+    ci.danger = board.attacks[Them];
+    uint64_t occupiedNoKing = board.allPieces ^ bitMasks[ci.kingSq];
+    for (uint64_t c = sliderCheckers; c; c &= c - 1) {
+        int sq = __builtin_ctzll(c);
+        ci.danger |= (board.pieceOn(sq) == BISHOP ? BishopAttacks(sq, occupiedNoKing)
+                    : board.pieceOn(sq) == ROOK   ? RookAttacks(sq, occupiedNoKing)
+                                                  : QueenAttacks(sq, occupiedNoKing));
+    }
+
+    // Sliders that would check through exactly one of our pieces pin it
+    ci.pinned = 0;
+    uint64_t enemy = board.occupancy[Them];
+    uint64_t pinners = (BishopAttacks(ci.kingSq, enemy) & diagonal) | (RookAttacks(ci.kingSq, enemy) & straight);
+    for (; pinners; pinners &= pinners - 1) {
+        uint64_t blockers = betweenBB[ci.kingSq][__builtin_ctzll(pinners)] & board.allPieces;
+        if (blockers && !(blockers & (blockers - 1))) ci.pinned |= blockers & own;
+    }
+    return ci;
+}
+
+CheckInfo ComputeCheckInfo(const Board& board, Color us) {
+    return us == WHITE ? ComputeCheckInfo<WHITE>(board) : ComputeCheckInfo<BLACK>(board);
+}
+
+// Squares a piece on sq may move to: the check mask, narrowed to the pin line if it is pinned
+inline uint64_t AllowedTargets(const CheckInfo& ci, int sq) {
+    return (ci.pinned & bitMasks[sq]) ? ci.checkMask & lineBB[ci.kingSq][sq] : ci.checkMask;
+}
+
+// Move kinds a generator call produces. Noisy moves are captures and promotions, quiet moves the rest
+enum GenType {
+    GEN_NOISY, GEN_QUIET, GEN_ALL
+};
+
+// Called only when the king is not in check. Every square the king crosses must be safe
+template<Color Us>
+void GenerateCastlingMoves(uint8_t castlingRights, uint64_t all, uint64_t danger, MoveList& moves) {
+    constexpr uint8_t KingsideRight = Us == WHITE ? 0b1000 : 0b0010;
+    constexpr uint8_t QueensideRight = Us == WHITE ? 0b0100 : 0b0001;
+    constexpr int King = Us == WHITE ? e1 : e8;
+    if ((castlingRights & KingsideRight) && !(all & castlingBB[2 * Us]) && !(danger & (bitMasks[King + 1] | bitMasks[King + 2]))) {
+        moves.add(Move(King, King + 2, CASTLING));
+    }
+    if ((castlingRights & QueensideRight) && !(all & castlingBB[2 * Us + 1]) && !(danger & (bitMasks[King - 1] | bitMasks[King - 2]))) {
+        moves.add(Move(King, King - 2, CASTLING));
+    }
+}
+
+void GenerateSlidingMoves(uint64_t pieces, Piece pieceType, uint64_t all, uint64_t targets, const CheckInfo& ci, MoveList& moves) {
+    while (pieces) {
+        int sq = __builtin_ctzll(pieces);
+        pieces &= pieces - 1;
+
+        uint64_t attacks = pieceType == BISHOP ? BishopAttacks(sq, all)
+                         : pieceType == ROOK   ? RookAttacks(sq, all)
+                                               : QueenAttacks(sq, all);
+        attacks &= targets & AllowedTargets(ci, sq);
+
+        while (attacks) {
+            int target = __builtin_ctzll(attacks);
+            attacks &= attacks - 1;
+            moves.add(Move(sq, target));
+        }
+    }
+}
+
+void GenerateNonSlidingMoves(uint64_t pieces, const uint64_t attackTable[64], uint64_t targets, MoveList& moves) {
+    while (pieces) {
+        int sq = __builtin_ctzll(pieces);
+        pieces &= pieces - 1;
+
+        uint64_t attacks = attackTable[sq];
+        attacks &= targets;
+
+        while (attacks) {
+            int target = __builtin_ctzll(attacks);
+            attacks &= attacks - 1;
+            moves.add(Move(sq, target));
+        }
+    }
+}
+
+// Adds one move per target square, each coming from offset squares behind it
+inline void AddPawnMoves(uint64_t targets, int offset, MoveList& moves) {
+    for (; targets; targets &= targets - 1) {
+        int to = __builtin_ctzll(targets);
+        moves.add(Move(to - offset, to));
+    }
+}
+
+inline void AddPromotions(uint64_t targets, int offset, MoveList& moves) {
+    for (; targets; targets &= targets - 1) {
+        int to = __builtin_ctzll(targets);
+        moves.add(Move(to - offset, to, PROMOTION, QUEEN));
+        moves.add(Move(to - offset, to, PROMOTION, ROOK));
+        moves.add(Move(to - offset, to, PROMOTION, BISHOP));
+        moves.add(Move(to - offset, to, PROMOTION, KNIGHT));
+    }
+}
+
+// Pushes, double pushes, captures and promotions of a whole pawn set at once by shifting it.
+// allowed must hold for every pawn in the set, so pinned pawns are passed one at a time
+template<Color Us>
+void GeneratePawnMoves(uint64_t pawns, uint64_t enemy, uint64_t empty, uint64_t allowed, GenType type, MoveList& moves) {
+    constexpr int Up = Us == WHITE ? 8 : -8;
+    constexpr int UpWest = Us == WHITE ? 7 : -9;
+    constexpr int UpEast = Us == WHITE ? 9 : -7;
+    constexpr uint64_t PushRank = Us == WHITE ? rank3 : rank6; // single pushes that may go on to a double push
+    constexpr uint64_t LastRank = Us == WHITE ? rank8 : rank1;
+
+    uint64_t single = ShiftBB<Up>(pawns) & empty;
+    if (type != GEN_QUIET) {
+        uint64_t west = ShiftBB<UpWest>(pawns) & ~fileH & enemy & allowed;
+        uint64_t east = ShiftBB<UpEast>(pawns) & ~fileA & enemy & allowed;
+        AddPromotions(single & allowed & LastRank, Up, moves);
+        AddPromotions(west & LastRank, UpWest, moves);
+        AddPromotions(east & LastRank, UpEast, moves);
+        AddPawnMoves(west & ~LastRank, UpWest, moves);
+        AddPawnMoves(east & ~LastRank, UpEast, moves);
+    }
+    if (type != GEN_NOISY) {
+        AddPawnMoves(single & allowed & ~LastRank, Up, moves);
+        AddPawnMoves(ShiftBB<Up>(single & PushRank) & empty & allowed, 2 * Up, moves);
+    }
+}
+
+// En passant removes two pawns from the board at once, which pin masks cannot describe
+// (e.g. king and rook on the same rank as both pawns), so each capture is tested directly
+template<Color Us>
+void GenerateEnPassant(const Board& board, const CheckInfo& ci, MoveList& moves) {
+    constexpr Color Them = ~Us;
+    if (!board.hasEnPassant()) return;
+    int to = board.getEnPassantTarget();
+    int capSq = Us == WHITE ? to - 8 : to + 8;
+
+    // Only evades a check given by the pawn that just double-pushed
+    if (ci.checkers & ~bitMasks[capSq]) return;
+
+    uint64_t diagonal = board.bitboard(Them, BISHOP) | board.bitboard(Them, QUEEN);
+    uint64_t straight = board.bitboard(Them, ROOK) | board.bitboard(Them, QUEEN);
+
+    for (uint64_t p = pawnAttacks[Them][to] & board.bitboard(Us, PAWN); p; p &= p - 1) {
+        int from = __builtin_ctzll(p);
+        uint64_t occupied = (board.allPieces ^ bitMasks[from] ^ bitMasks[capSq]) | bitMasks[to];
+        if ((BishopAttacks(ci.kingSq, occupied) & diagonal) || (RookAttacks(ci.kingSq, occupied) & straight)) continue;
+        moves.add(Move(from, to, EN_PASSANT));
+    }
+}
+
+// Generates only legal moves of the requested kind, no move is made to test it
+template<Color Us>
+void GenerateMoves(const Board& board, const CheckInfo& ci, GenType type, MoveList& moves) {
+    uint64_t filter = type == GEN_ALL ? ~0ULL : type == GEN_QUIET ? ~board.allPieces : board.allPieces;
+    uint64_t targets = ~board.occupancy[Us] & filter;
+
+    GenerateNonSlidingMoves(board.bitboard(Us, KING), kingAttacks, targets & ~ci.danger, moves);
+    if (ci.checkers & (ci.checkers - 1)) return; // double check, only the king can move
+    GenerateSlidingMoves(board.bitboard(Us, BISHOP), BISHOP, board.allPieces, targets, ci, moves);
+    GenerateSlidingMoves(board.bitboard(Us, ROOK), ROOK, board.allPieces, targets, ci, moves);
+    GenerateSlidingMoves(board.bitboard(Us, QUEEN), QUEEN, board.allPieces, targets, ci, moves);
+    GenerateNonSlidingMoves(board.bitboard(Us, KNIGHT) & ~ci.pinned, knightAttacks, targets & ci.checkMask, moves);
+    uint64_t pawns = board.bitboard(Us, PAWN);
+    GeneratePawnMoves<Us>(pawns & ~ci.pinned, board.occupancy[~Us], ~board.allPieces, ci.checkMask, type, moves);
+    for (uint64_t p = pawns & ci.pinned; p; p &= p - 1) {
+        GeneratePawnMoves<Us>(p & -p, board.occupancy[~Us], ~board.allPieces, AllowedTargets(ci, __builtin_ctzll(p)), type, moves);
+    }
+    if (type != GEN_QUIET) GenerateEnPassant<Us>(board, ci, moves);
+    if (type != GEN_NOISY && !ci.checkers) GenerateCastlingMoves<Us>(board.castlingRights, board.allPieces, ci.danger, moves);
+}
+
+void GenerateMoves(const Board& board, const CheckInfo& ci, GenType type, MoveList& moves) {
+    STAT_TIME(PHASE_MOVEGEN);
+    if (board.whiteToMove) GenerateMoves<WHITE>(board, ci, type, moves);
+    else GenerateMoves<BLACK>(board, ci, type, moves);
+}
+
+void GenerateLegalMoves(const Board& board, MoveList& moves) {
+    STAT_TIME(PHASE_MOVEGEN);
+    if (board.whiteToMove) GenerateMoves<WHITE>(board, ComputeCheckInfo<WHITE>(board), GEN_ALL, moves);
+    else GenerateMoves<BLACK>(board, ComputeCheckInfo<BLACK>(board), GEN_ALL, moves);
+}
+
+// Whether a move remembered from another position (hash move, killer, countermove) is legal here
+template<Color Us>
+bool IsLegalMove(const Board& board, const CheckInfo& ci, Move move) {
+    constexpr int Up = Us == WHITE ? 8 : -8;
+    uint64_t own = board.occupancy[Us];
+    int from = move.from(), to = move.to();
+    uint64_t toBB = bitMasks[to];
+    if (move == NO_MOVE || !(own & bitMasks[from]) || (own & toBB)) return false;
+
+    if (move.isCastling() || move.isEnPassant()) {
+        MoveList special;
+        if (move.isEnPassant()) GenerateEnPassant<Us>(board, ci, special);
+        else if (!ci.checkers) GenerateCastlingMoves<Us>(board.castlingRights, board.allPieces, ci.danger, special);
+        for (Move m : special) {
+            if (m == move) return true;
+        }
+        return false;
+    }
+
+    Piece piece = board.pieceOn(from);
+    if (move.isPromotion() != (piece == PAWN && (toBB & (rank1 | rank8)) != 0)) return false;
+    if (!move.isPromotion() && move.promotion() != KNIGHT) return false; // stray promotion bits
+    if (piece == KING) return (kingAttacks[from] & toBB & ~ci.danger) != 0;
+    if (ci.checkers & (ci.checkers - 1)) return false;
+    if (!(AllowedTargets(ci, from) & toBB)) return false;
+
+    switch (piece) {
+        case PAWN: {
+            if (pawnAttacks[Us][from] & toBB & board.allPieces) return true;
+            if (to == from + Up) return !(board.allPieces & toBB);
+            return to == from + 2 * Up && (bitMasks[from] & (Us == WHITE ? rank2 : rank7))
+                && !(board.allPieces & (toBB | bitMasks[from + Up]));
+        }
+        case KNIGHT: return (knightAttacks[from] & toBB) != 0;
+        case BISHOP: return (BishopAttacks(from, board.allPieces) & toBB) != 0;
+        case ROOK: return (RookAttacks(from, board.allPieces) & toBB) != 0;
+        case QUEEN: return (QueenAttacks(from, board.allPieces) & toBB) != 0;
+        default: return false;
+    }
+}
+
+bool IsLegalMove(const Board& board, const CheckInfo& ci, Move move) {
+    return board.whiteToMove ? IsLegalMove<WHITE>(board, ci, move) : IsLegalMove<BLACK>(board, ci, move);
+}
+
+
+// Perft: counts leaf nodes of the legal move tree, used to validate and time move generation.
+// Leaves are bulk counted (depth 1 returns the legal move count without making the moves).
+struct PerftEntry {
+    atomic<uint64_t> check; // key ^ data, so a torn write from another thread never verifies
+    atomic<uint64_t> data;  // nodes << 8 | depth
+};
+
+struct PerftOptions {
+    int threads = 1;
+    size_t hashMB = 0;
+};
+
+class PerftTable {
+public:
+    explicit PerftTable(size_t megabytes) {
+        size_t count = (megabytes << 20) / sizeof(PerftEntry);
+        if (count == 0) return;
+        size = 1;
+        while (size * 2 <= count) size *= 2;
+        entries.reset(new PerftEntry[size]);
+        for (size_t i = 0; i < size; i++) {
+            entries[i].check.store(0, memory_order_relaxed);
+            entries[i].data.store(0, memory_order_relaxed);
+        }
+    }
+
+    bool enabled() const { return size != 0; }
+
+    bool probe(uint64_t key, int depth, uint64_t& nodes) const {
+        const PerftEntry& e = entries[key & (size - 1)];
+        uint64_t data = e.data.load(memory_order_relaxed);
+        if ((e.check.load(memory_order_relaxed) ^ data) != key || (int)(data & 0xFF) != depth) return false;
+        nodes = data >> 8;
+        return true;
+    }
+
+    void store(uint64_t key, int depth, uint64_t nodes) {
+        PerftEntry& e = entries[key & (size - 1)];
+        uint64_t data = (nodes << 8) | (uint64_t)depth;
+        e.check.store(key ^ data, memory_order_relaxed);
+        e.data.store(data, memory_order_relaxed);
+    }
+
+private:
+    unique_ptr<PerftEntry[]> entries;
+    size_t size = 0;
+};
+
+uint64_t Perft(Board& board, int depth, PerftTable* table = nullptr) {
+    if (depth == 0) return 1;
+    MoveList moves;
+    GenerateLegalMoves(board, moves);
+    if (depth == 1) return moves.size();
+
+    uint64_t key = 0, nodes = 0;
+    if (table) {
+        key = board.zobristKey;
+        if (table->probe(key, depth, nodes)) return nodes;
+    }
+
+    for (Move move : moves) {
+        board.make_move(move);
+        nodes += Perft(board, depth - 1, table);
+        board.unmake_move();
+    }
+
+    if (table) table->store(key, depth, nodes);
+    return nodes;
+}
+
+string moveToString(Move move) {
+    string s = indexToSquare(move.from()) + indexToSquare(move.to());
+    if (move.isPromotion()) s += "nbrq"[move.promotion() - KNIGHT];
+    return s;
+}
+
+constexpr const char* START_FEN = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+// Decodes a UCI move string in the given position, the move type follows from the pieces involved
+Move ParseMove(const Board& board, string_view uci) {
+    int from = (uci[1] - '1') * 8 + (uci[0] - 'a');
+    int to = (uci[3] - '1') * 8 + (uci[2] - 'a');
+
+    if (uci.length() >= 5) {
+        Piece promotion = charToPiece(uci[4]);
+        return promotion >= KNIGHT && promotion <= QUEEN ? Move(from, to, PROMOTION, promotion) : NO_MOVE;
+    }
+    if (board.pieceOn(from) == PAWN && board.hasEnPassant() && to == board.getEnPassantTarget()) return Move(from, to, EN_PASSANT);
+    if (board.pieceOn(from) == KING && abs(to - from) == 2) return Move(from, to, CASTLING);
+    return Move(from, to);
+}
+
+// Counts every root move's subtree, splitting the root moves across worker threads
+vector<uint64_t> PerftRoot(Board& board, int depth, const MoveList& rootMoves, const PerftOptions& options) {
+    vector<uint64_t> counts(rootMoves.size(), 0);
+    if (depth < 1) return counts;
+
+    unique_ptr<PerftTable> table;
+    if (options.hashMB > 0) table = make_unique<PerftTable>(options.hashMB);
+    PerftTable* tablePtr = table && table->enabled() ? table.get() : nullptr;
+
+    atomic<int> nextMove{0};
+    auto worker = [&] {
+        Board local = board;
+        for (int i = nextMove++; i < rootMoves.size(); i = nextMove++) {
+            local.make_move(rootMoves[i]);
+            counts[i] = Perft(local, depth - 1, tablePtr);
+            local.unmake_move();
+        }
+    };
+
+    int threadCount = max(1, min<int>(options.threads, (int)rootMoves.size()));
+    vector<thread> helpers;
+    for (int i = 1; i < threadCount; i++) helpers.emplace_back(worker);
+    worker();
+    for (thread& t : helpers) t.join();
+
+    return counts;
+}
+
+struct PerftPosition {
+    const char* name;
+    const char* fen;
+    vector<uint64_t> expected; // expected[d - 1] is the node count at depth d
+};
+
+const vector<PerftPosition> perftSuite = {
+    {"startpos", "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+        {20, 400, 8902, 197281, 4865609, 119060324}},
+    {"kiwipete", "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+        {48, 2039, 97862, 4085603, 193690690}},
+    {"en passant", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+        {14, 191, 2812, 43238, 674624, 11030083}},
+    {"promotions", "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+        {6, 264, 9467, 422333, 15833292}},
+    {"promotions mirrored", "r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ - 0 1",
+        {6, 264, 9467, 422333, 15833292}},
+    {"discovered checks", "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+        {44, 1486, 62379, 2103487, 89941194}},
+    {"middlegame", "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+        {46, 2079, 89890, 3894594, 164075551}},
+};
+
+double ElapsedSeconds(chrono::high_resolution_clock::time_point start) {
+    return chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+}
+
+void RunPerft(Board& board, int depth, const PerftOptions& options, bool divide) {
+    auto start_time = chrono::high_resolution_clock::now();
+    MoveList rootMoves;
+    GenerateLegalMoves(board, rootMoves);
+    vector<uint64_t> counts = PerftRoot(board, depth, rootMoves, options);
+
+    uint64_t total = depth == 0 ? 1 : 0;
+    for (int i = 0; i < rootMoves.size(); i++) {
+        total += counts[i];
+        if (divide) cout << moveToString(rootMoves[i]) << ": " << counts[i] << "\n";
+    }
+
+    double seconds = ElapsedSeconds(start_time);
+    cout << "Nodes searched: " << total << "\n";
+    cout << "Time: " << (uint64_t)(seconds * 1000) << " ms, NPS: " << (uint64_t)(total / max(seconds, 1e-9)) << "\n" << flush;
+}
+
+// Runs every suite position up to maxDepth (capped by the known counts) and checks the results
+void RunPerftSuite(int maxDepth, const PerftOptions& options) {
+    uint64_t totalNodes = 0;
+    int failures = 0;
+    auto suite_start = chrono::high_resolution_clock::now();
+
+    for (const PerftPosition& position : perftSuite) {
+        Board board;
+        board.setBB(position.fen);
+        int depth = min<int>(maxDepth, position.expected.size());
+        MoveList rootMoves;
+        GenerateLegalMoves(board, rootMoves);
+
+        auto start_time = chrono::high_resolution_clock::now();
+        vector<uint64_t> counts = PerftRoot(board, depth, rootMoves, options);
+        double seconds = ElapsedSeconds(start_time);
+
+        uint64_t nodes = 0;
+        for (uint64_t c : counts) nodes += c;
+        bool ok = nodes == position.expected[depth - 1];
+        if (!ok) failures++;
+        totalNodes += nodes;
+
+        cout << (ok ? "[PASS] " : "[FAIL] ") << position.name << " depth " << depth
+             << " nodes " << nodes;
+        if (!ok) cout << " (expected " << position.expected[depth - 1] << ")";
+        cout << " time " << (uint64_t)(seconds * 1000) << " ms"
+             << " nps " << (uint64_t)(nodes / max(seconds, 1e-9)) << "\n" << flush;
+    }
+
+    double seconds = ElapsedSeconds(suite_start);
+    cout << "Suite: " << (perftSuite.size() - failures) << "/" << perftSuite.size() << " passed, "
+         << totalNodes << " nodes in " << (uint64_t)(seconds * 1000) << " ms, nps "
+         << (uint64_t)(totalNodes / max(seconds, 1e-9)) << "\n" << flush;
+}
+
+// Reads the trailing "threads N" / "hash MB" options of the perft commands
+PerftOptions ParsePerftOptions(istringstream& iss) {
+    PerftOptions options;
+    string token;
+    while (iss >> token) {
+        if (token == "threads") iss >> options.threads;
+        else if (token == "hash") iss >> options.hashMB;
+    }
+    return options;
+}
+
+// Search: iterative-deepening negamax with principal variation search and aspiration windows.
+// Limits are polled every few thousand nodes so the per-node cost stays a counter increment.
+constexpr int MAX_SEARCH_PLY = 128;
+constexpr int INF_SCORE = 32001;
+constexpr int MATE_SCORE = 32000;
+constexpr int MATE_BOUND = MATE_SCORE - MAX_SEARCH_PLY; // scores beyond this are mates
+constexpr int MOVE_OVERHEAD_MS = 30; // latency reserve per move for the bridge and Lichess
+constexpr int MAX_THREADS = 256;
+
+constexpr int pieceValues[7] = {0, 100, 320, 330, 500, 900, 0};
+constexpr int DELTA_MARGIN = 200; // quiescence skips captures that stay this far below alpha
+
+// NNUE kernels: dst = src + sum(adds) - sum(subs) over one hidden layer, and the clipped ReLU output dot product
+using NnueUpdateFn = void (*)(int16_t* dst, const int16_t* src, const int16_t* const* adds, int addCount,
+                              const int16_t* const* subs, int subCount);
+using NnueOutputFn = int32_t (*)(const int16_t* us, const int16_t* them, const int16_t* weights);
+
+void NnueUpdateScalar(int16_t* dst, const int16_t* src, const int16_t* const* adds, int addCount,
+                      const int16_t* const* subs, int subCount) {
+    for (int i = 0; i < NNUE_HIDDEN; i++) {
+        int16_t value = src[i];
+        for (int a = 0; a < addCount; a++) value += adds[a][i];
+        for (int s = 0; s < subCount; s++) value -= subs[s][i];
+        dst[i] = value;
+    }
+}
+
+int32_t NnueOutputScalar(const int16_t* us, const int16_t* them, const int16_t* weights) {
+    int32_t sum = 0;
+    for (int i = 0; i < NNUE_HIDDEN; i++) {
+        sum += min<int>(max<int>(us[i], 0), NNUE_QA) * weights[i];
+        sum += min<int>(max<int>(them[i], 0), NNUE_QA) * weights[NNUE_HIDDEN + i];
+    }
+    return sum;
+}
+
+#ifdef __x86_64__
+void NnueUpdateSse2(int16_t* dst, const int16_t* src, const int16_t* const* adds, int addCount,
+                    const int16_t* const* subs, int subCount) {
+    for (int i = 0; i < NNUE_HIDDEN; i += 8) {
+        __m128i value = _mm_load_si128((const __m128i*)(src + i));
+        for (int a = 0; a < addCount; a++) value = _mm_add_epi16(value, _mm_load_si128((const __m128i*)(adds[a] + i)));
+        for (int s = 0; s < subCount; s++) value = _mm_sub_epi16(value, _mm_load_si128((const __m128i*)(subs[s] + i)));
+        _mm_store_si128((__m128i*)(dst + i), value);
+    }
+}
+
+int32_t NnueOutputSse2(const int16_t* us, const int16_t* them, const int16_t* weights) {
+    const __m128i zero = _mm_setzero_si128(), ceiling = _mm_set1_epi16(NNUE_QA);
+    __m128i sum = _mm_setzero_si128();
+    for (int i = 0; i < NNUE_HIDDEN; i += 8) {
+        __m128i u = _mm_min_epi16(_mm_max_epi16(_mm_load_si128((const __m128i*)(us + i)), zero), ceiling);
+        __m128i t = _mm_min_epi16(_mm_max_epi16(_mm_load_si128((const __m128i*)(them + i)), zero), ceiling);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(u, _mm_load_si128((const __m128i*)(weights + i))));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(t, _mm_load_si128((const __m128i*)(weights + NNUE_HIDDEN + i))));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+    return _mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("avx2")))
+void NnueUpdateAvx2(int16_t* dst, const int16_t* src, const int16_t* const* adds, int addCount,
+                    const int16_t* const* subs, int subCount) {
+    for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+        __m256i value = _mm256_load_si256((const __m256i*)(src + i));
+        for (int a = 0; a < addCount; a++) value = _mm256_add_epi16(value, _mm256_load_si256((const __m256i*)(adds[a] + i)));
+        for (int s = 0; s < subCount; s++) value = _mm256_sub_epi16(value, _mm256_load_si256((const __m256i*)(subs[s] + i)));
+        _mm256_store_si256((__m256i*)(dst + i), value);
+    }
+}
+
+__attribute__((target("avx2")))
+int32_t NnueOutputAvx2(const int16_t* us, const int16_t* them, const int16_t* weights) {
+    const __m256i zero = _mm256_setzero_si256(), ceiling = _mm256_set1_epi16(NNUE_QA);
+    __m256i sum = _mm256_setzero_si256();
+    for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+        __m256i u = _mm256_min_epi16(_mm256_max_epi16(_mm256_load_si256((const __m256i*)(us + i)), zero), ceiling);
+        __m256i t = _mm256_min_epi16(_mm256_max_epi16(_mm256_load_si256((const __m256i*)(them + i)), zero), ceiling);
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(u, _mm256_load_si256((const __m256i*)(weights + i))));
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(t, _mm256_load_si256((const __m256i*)(weights + NNUE_HIDDEN + i))));
+    }
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+    return _mm_cvtsi128_si32(half);
+}
+#endif
+
+NnueUpdateFn nnueUpdate = NnueUpdateScalar;
+NnueOutputFn nnueOutput = NnueOutputScalar;
+const char* nnueKernel = "scalar";
+
+// Picks the widest kernels the running CPU supports, so one binary serves every x86-64 host
+void InitNnueKernels() {
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2")) {
+        nnueUpdate = NnueUpdateAvx2;
+        nnueOutput = NnueOutputAvx2;
+        nnueKernel = "avx2";
+    } else {
+        nnueUpdate = NnueUpdateSse2;
+        nnueOutput = NnueOutputSse2;
+        nnueKernel = "sse2";
+    }
+#endif
+}
+
+// Raw little-endian int16 dump: feature weights (input-major), feature bias, output weights, output bias
+bool LoadNetwork(const string& path) {
+    ifstream file(path, ios::binary);
+    if (!file) return false;
+    auto net = make_unique<NnueNetwork>();
+    file.read((char*)net->featureWeights, sizeof(net->featureWeights));
+    file.read((char*)net->featureBias, sizeof(net->featureBias));
+    file.read((char*)net->outputWeights, sizeof(net->outputWeights));
+    file.read((char*)&net->outputBias, sizeof(net->outputBias));
+    if (!file) return false;
+
+    InitNnueKernels();
+    nnueNet = std::move(net);
+    nnueEpoch++;
+    return true;
+}
+
+inline bool NnueMirrored(int kingSq) {
+    return (kingSq & 7) >= 4;
+}
+
+inline const int16_t* NnueColumn(int perspective, bool mirrored, int color, int piece, int sq) {
+    int oriented = sq ^ (perspective == WHITE ? 0 : 56) ^ (mirrored ? 7 : 0);
+    return nnueNet->featureWeights[(color == perspective ? 0 : 384) + (piece - 1) * 64 + oriented];
+}
+
+// Rebuilds a perspective from its cached last refresh in the same mirror bucket, touching only pieces that moved since
+void NnueRefresh(const Board& board, int perspective, int16_t* dst) {
+    bool mirrored = NnueMirrored(perspective == WHITE ? board.kingSq[WHITE] : board.kingSq[BLACK]);
+    NnueRefreshEntry& entry = board.nnueRefresh[perspective][mirrored];
+    if (entry.epoch != nnueEpoch) {
+        memcpy(entry.values, nnueNet->featureBias, sizeof(entry.values));
+        memset(entry.pieces, 0, sizeof(entry.pieces));
+        entry.epoch = nnueEpoch;
+    }
+
+    const int16_t* adds[32];
+    const int16_t* subs[32];
+    int addCount = 0, subCount = 0;
+    for (int color = 0; color < 2; color++) {
+        for (int piece = PAWN; piece <= KING; piece++) {
+            uint64_t current = board.bitboard(color, (Piece)piece);
+            uint64_t added = current & ~entry.pieces[color][piece-1];
+            uint64_t removed = entry.pieces[color][piece-1] & ~current;
+            entry.pieces[color][piece-1] = current;
+            for (; added; added &= added - 1)
+                adds[addCount++] = NnueColumn(perspective, mirrored, color, piece, __builtin_ctzll(added));
+            for (; removed; removed &= removed - 1)
+                subs[subCount++] = NnueColumn(perspective, mirrored, color, piece, __builtin_ctzll(removed));
+        }
+    }
+    nnueUpdate(entry.values, entry.values, adds, addCount, subs, subCount);
+    memcpy(dst, entry.values, sizeof(entry.values));
+}
+
+// Brings one perspective of the current ply up to date from the nearest computed ancestor, replaying the moves
+// recorded in history. A king crossing the mirror line changes every input, so that perspective is refreshed instead
+void NnueUpdateAccumulator(const Board& board, int perspective) {
+    size_t ply = board.history.size();
+    if (board.nnueStack.size() <= ply) board.nnueStack.resize(ply + 1);
+    if (board.nnueStack[ply].epoch[perspective] == nnueEpoch) return;
+
+    int sideToMove = board.whiteToMove ? WHITE : BLACK;
+    size_t start = ply;
+    while (board.nnueStack[start].epoch[perspective] != nnueEpoch) {
+        bool crossed = false;
+        if (start > 0) {
+            const UndoInfo& undo = board.history[start-1];
+            int mover = (ply - (start - 1)) & 1 ? 1 - sideToMove : sideToMove;
+            crossed = undo.movedPiece == KING && mover == perspective
+                   && NnueMirrored(undo.move.from()) != NnueMirrored(undo.move.to());
+        }
+        if (start == 0 || crossed) {
+            NnueRefresh(board, perspective, board.nnueStack[ply].values[perspective]);
+            board.nnueStack[ply].epoch[perspective] = nnueEpoch;
+            return;
+        }
+        start--;
+    }
+
+    bool mirrored = NnueMirrored(perspective == WHITE ? board.kingSq[WHITE] : board.kingSq[BLACK]);
+    for (size_t j = start; j < ply; j++) {
+        const UndoInfo& undo = board.history[j];
+        int us = (ply - j) & 1 ? 1 - sideToMove : sideToMove;
+        int from = undo.move.from(), to = undo.move.to();
+        const int16_t* adds[2];
+        const int16_t* subs[2];
+        int addCount = 0, subCount = 0;
+
+        subs[subCount++] = NnueColumn(perspective, mirrored, us, undo.movedPiece, from);
+        adds[addCount++] = NnueColumn(perspective, mirrored, us, undo.move.isPromotion() ? undo.move.promotion() : (Piece)undo.movedPiece, to);
+        if (undo.capturedPiece != EMPTY)
+            subs[subCount++] = NnueColumn(perspective, mirrored, 1 - us, undo.capturedPiece, to);
+        else if (undo.move.isEnPassant())
+            subs[subCount++] = NnueColumn(perspective, mirrored, 1 - us, PAWN, us == WHITE ? to - 8 : to + 8);
+        else if (undo.move.isCastling()) {
+            bool kingside = to > from;
+            subs[subCount++] = NnueColumn(perspective, mirrored, us, ROOK, kingside ? to + 1 : to - 2);
+            adds[addCount++] = NnueColumn(perspective, mirrored, us, ROOK, kingside ? to - 1 : to + 1);
+        }
+
+        nnueUpdate(board.nnueStack[j+1].values[perspective], board.nnueStack[j].values[perspective],
+                   adds, addCount, subs, subCount);
+        board.nnueStack[j+1].epoch[perspective] = nnueEpoch;
+    }
+}
+
+// Network evaluation from the side to move's point of view
+int NnueEvaluate(const Board& board) {
+    NnueUpdateAccumulator(board, WHITE);
+    NnueUpdateAccumulator(board, BLACK);
+    const NnueAccumulator& acc = board.nnueStack[board.history.size()];
+
+#ifdef NEPTUNE_DEBUG
+    for (int perspective = 0; perspective < 2; perspective++) {
+        bool mirrored = NnueMirrored(perspective == WHITE ? board.kingSq[WHITE] : board.kingSq[BLACK]);
+        int16_t full[NNUE_HIDDEN];
+        memcpy(full, nnueNet->featureBias, sizeof(full));
+        for (int sq = 0; sq < 64; sq++) {
+            if (board.pieceOn(sq) == EMPTY) continue;
+            const int16_t* column = NnueColumn(perspective, mirrored, (board.occupancy[WHITE] & bitMasks[sq]) ? WHITE : BLACK,
+                                               board.pieceOn(sq), sq);
+            for (int i = 0; i < NNUE_HIDDEN; i++) full[i] += column[i];
+        }
+        if (memcmp(full, acc.values[perspective], sizeof(full)) != 0) {
+            cerr << "[ERROR] Incremental NNUE accumulator diverged\n";
+            abort();
+        }
+    }
+#endif
+
+    int us = board.whiteToMove ? WHITE : BLACK;
+    int32_t output = nnueOutput(acc.values[us], acc.values[1 - us], nnueNet->outputWeights) + nnueNet->outputBias;
+    int score = output * NNUE_SCALE / (NNUE_QA * NNUE_QB);
+    return max(-MATE_BOUND + 1, min(MATE_BOUND - 1, score));
+}
+
+constexpr int MOBILITY_WEIGHT = S(3, 4); // per square attacked that is not our own piece
+constexpr int KING_ZONE_ATTACK = S(-12, -4); // per enemy-attacked square around our king
+constexpr int PAWN_SHIELD = S(12, 0); // per own pawn next to our king
+constexpr int ROOK_OPEN_FILE = S(35, 10);
+constexpr int ROOK_SEMI_OPEN_FILE = S(15, 8);
+constexpr int DOUBLED_PAWN = S(-10, -20); // per pawn with an own pawn behind it on its file
+constexpr int ISOLATED_PAWN = S(-8, -12); // no own pawn on either neighbouring file
+constexpr int BACKWARD_PAWN = S(-6, -8); // stop square attacked by an enemy pawn, no own pawn can ever defend it
+constexpr int passedPawnBonus[8] = {0, S(5, 10), S(5, 15), S(10, 25), S(25, 50), S(45, 90), S(75, 140), 0}; // by relative rank
+
+enum EvalTerm {
+    TERM_PSQT, TERM_MOBILITY, TERM_KING_SAFETY, TERM_ROOK_FILES, TERM_PAWNS, TERM_COUNT
+};
+
+const char* evalTermNames[TERM_COUNT] = {"Material+PSQT", "Mobility", "King safety", "Rook files", "Pawns"};
+
+// Per-side packed scores of each term, only filled by Evaluate<true>
+struct EvalTrace {
+    int terms[TERM_COUNT][2] = {};
+};
+
+inline uint64_t NorthFill(uint64_t bb) {
+    bb |= bb << 8;
+    bb |= bb << 16;
+    bb |= bb << 32;
+    return bb;
+}
+
+inline uint64_t SouthFill(uint64_t bb) {
+    bb |= bb >> 8;
+    bb |= bb >> 16;
+    bb |= bb >> 32;
+    return bb;
+}
+
+inline uint64_t FileFill(uint64_t bb) {
+    return NorthFill(bb) | SouthFill(bb);
+}
+
+inline uint64_t AdjacentFiles(uint64_t files) {
+    return ((files << 1) & ~fileA) | ((files >> 1) & ~fileH);
+}
+
+// Pawn structure for one pair of pawn bitboards, with the masks other terms reuse. The king shelter depends on
+// the king square as well, it is cached next to the square it was computed for and redone when the king moved
+struct PawnEntry {
+    uint64_t pawns[2] = {~0ULL, ~0ULL}; // kept whole, so a hit is never a collision
+    int score[2]; // packed, per side
+    uint64_t passed[2];
+    uint64_t attacks[2]; // squares the pawns attack now
+    uint64_t attackSpan[2]; // squares they attack now or after advancing
+    uint64_t openFiles; // files without pawns
+    uint64_t semiOpenFiles[2]; // files with enemy pawns only
+    uint8_t kingSq[2] = {64, 64};
+    int shelter[2];
+};
+
+void ComputePawnEntry(const Board& board, PawnEntry& entry) {
+    entry.pawns[WHITE] = board.bitboard(WHITE, PAWN);
+    entry.pawns[BLACK] = board.bitboard(BLACK, PAWN);
+    entry.openFiles = ~FileFill(board.bitboard(WHITE, PAWN) | board.bitboard(BLACK, PAWN));
+    entry.kingSq[WHITE] = entry.kingSq[BLACK] = 64;
+    for (int color = 0; color < 2; color++) {
+        entry.attacks[color] = PawnAttacksSetwise(board.bitboard(color, PAWN), color);
+        entry.attackSpan[color] = color == WHITE ? NorthFill(entry.attacks[color]) : SouthFill(entry.attacks[color]);
+    }
+
+    for (int color = 0; color < 2; color++) {
+        uint64_t own = board.bitboard(color, PAWN), enemy = board.bitboard(color ^ 1, PAWN);
+        uint64_t ahead = color == WHITE ? NorthFill(own << 8) : SouthFill(own >> 8);
+        uint64_t stops = color == WHITE ? own << 8 : own >> 8;
+        uint64_t enemyFront = color == WHITE ? SouthFill(enemy >> 8) : NorthFill(enemy << 8);
+
+        entry.passed[color] = own & ~(enemyFront | AdjacentFiles(enemyFront));
+        entry.semiOpenFiles[color] = ~FileFill(own) & ~entry.openFiles;
+        int score = DOUBLED_PAWN * __builtin_popcountll(own & ahead)
+                  + ISOLATED_PAWN * __builtin_popcountll(own & ~AdjacentFiles(FileFill(own)))
+                  + BACKWARD_PAWN * __builtin_popcountll(stops & entry.attacks[color ^ 1] & ~entry.attackSpan[color]);
+        for (uint64_t passed = entry.passed[color]; passed; passed &= passed - 1) {
+            int rank = __builtin_ctzll(passed) >> 3;
+            score += passedPawnBonus[color == WHITE ? rank : 7 - rank];
+        }
+        entry.score[color] = score;
+    }
+}
+
+// Pawn hash, one per search thread so it needs no synchronization. Keyed on the pawn bitboards alone,
+// which change far less often than the rest of the position
+class PawnTable {
+public:
+    static constexpr int BITS = 14;
+
+    PawnTable() : entries(size_t(1) << BITS) {}
+
+    PawnEntry& Probe(const Board& board) {
+        uint64_t key = board.bitboard(WHITE, PAWN) * 0x9E3779B97F4A7C15ULL ^ board.bitboard(BLACK, PAWN) * 0xC2B2AE3D27D4EB4FULL;
+        PawnEntry& entry = entries[key >> (64 - BITS)];
+        probes++;
+        if (entry.pawns[WHITE] == board.bitboard(WHITE, PAWN) && entry.pawns[BLACK] == board.bitboard(BLACK, PAWN)) hits++;
+        else ComputePawnEntry(board, entry);
+        return entry;
+    }
+
+    uint64_t hits = 0, probes = 0;
+
+private:
+    vector<PawnEntry> entries;
+};
+
+inline int KingShelter(const Board& board, PawnEntry& pawns, Color color) {
+    int kingSq = color == WHITE ? board.kingSq[WHITE] : board.kingSq[BLACK];
+    if (pawns.kingSq[color] != kingSq) {
+        pawns.kingSq[color] = (uint8_t)kingSq;
+        pawns.shelter[color] = PAWN_SHIELD * __builtin_popcountll(kingAttacks[kingSq] & board.bitboard(color, PAWN));
+    }
+    return pawns.shelter[color];
+}
+
+// Terms that depend on the whole position rather than on single pieces, packed and from color's view
+inline void EvaluateSide(const Board& board, PawnEntry& pawns, Color color, int& mobility, int& kingSafety, int& rookFiles) {
+    uint64_t own = color == WHITE ? board.occupancy[WHITE] : board.occupancy[BLACK];
+    uint64_t ownAttacks = color == WHITE ? board.attacks[WHITE] : board.attacks[BLACK];
+    uint64_t enemyAttacks = color == WHITE ? board.attacks[BLACK] : board.attacks[WHITE];
+    int kingSq = color == WHITE ? board.kingSq[WHITE] : board.kingSq[BLACK];
+    uint64_t kingZone = kingAttacks[kingSq] | bitMasks[kingSq];
+
+    mobility = MOBILITY_WEIGHT * __builtin_popcountll(ownAttacks & ~own);
+    kingSafety = KING_ZONE_ATTACK * __builtin_popcountll(enemyAttacks & kingZone) + KingShelter(board, pawns, color);
+
+    uint64_t rooks = board.bitboard(color, ROOK);
+    rookFiles = ROOK_OPEN_FILE * __builtin_popcountll(rooks & pawns.openFiles)
+              + ROOK_SEMI_OPEN_FILE * __builtin_popcountll(rooks & pawns.semiOpenFiles[color]);
+}
+
+// Tapered evaluation from the side to move's point of view, material and piece-square terms come from make_move.
+// Without a pawn table the pawn structure is computed from scratch
+template<bool Trace>
+int Evaluate(const Board& board, PawnTable* pawnTable, EvalTrace* trace = nullptr) {
+    PawnEntry scratch;
+    PawnEntry* pawns = &scratch;
+    if (pawnTable) pawns = &pawnTable->Probe(board);
+    else ComputePawnEntry(board, scratch);
+
+    int mobility[2], kingSafety[2], rookFiles[2];
+    EvaluateSide(board, *pawns, WHITE, mobility[WHITE], kingSafety[WHITE], rookFiles[WHITE]);
+    EvaluateSide(board, *pawns, BLACK, mobility[BLACK], kingSafety[BLACK], rookFiles[BLACK]);
+
+    int score = board.psqt + mobility[WHITE] - mobility[BLACK] + kingSafety[WHITE] - kingSafety[BLACK]
+              + rookFiles[WHITE] - rookFiles[BLACK] + pawns->score[WHITE] - pawns->score[BLACK];
+
+    if constexpr (Trace) {
+        int psqt[2] = {};
+        for (int sq = 0; sq < 64; sq++) {
+            int color = (board.occupancy[WHITE] & bitMasks[sq]) ? WHITE : BLACK;
+            psqt[color] += pieceSquare[color][board.pieceOn(sq)][sq];
+        }
+        for (int color = 0; color < 2; color++) {
+            trace->terms[TERM_PSQT][color] = color == WHITE ? psqt[color] : -psqt[color];
+            trace->terms[TERM_MOBILITY][color] = mobility[color];
+            trace->terms[TERM_KING_SAFETY][color] = kingSafety[color];
+            trace->terms[TERM_ROOK_FILES][color] = rookFiles[color];
+            trace->terms[TERM_PAWNS][color] = pawns->score[color];
+        }
+    }
+
+    int mgPhase = std::min<int>(board.phase, MAX_PHASE);
+    int tapered = (MgScore(score) * mgPhase + EgScore(score) * (MAX_PHASE - mgPhase)) / MAX_PHASE;
+    return board.whiteToMove ? tapered : -tapered;
+}
+
+int Evaluate(const Board& board, PawnTable* pawnTable = nullptr) {
+    STAT_TIME(PHASE_EVAL);
+    if (nnueNet && useNnue) return NnueEvaluate(board);
+    return Evaluate<false>(board, pawnTable);
+}
+
+void PrintEval(const Board& board) {
+    EvalTrace trace;
+    int score = Evaluate<true>(board, nullptr, &trace);
+    cout << "Term            |    White    |    Black    |    Total\n"
+         << "                |   MG    EG  |   MG    EG  |   MG    EG\n";
+    for (int term = 0; term < TERM_COUNT; term++) {
+        int white = trace.terms[term][WHITE], black = trace.terms[term][BLACK];
+        cout << left << setw(15) << evalTermNames[term] << right
+             << " | " << setw(5) << MgScore(white) << " " << setw(5) << EgScore(white)
+             << " | " << setw(5) << MgScore(black) << " " << setw(5) << EgScore(black)
+             << " | " << setw(5) << MgScore(white - black) << " " << setw(5) << EgScore(white - black) << "\n";
+    }
+    cout << "Phase: " << (int)board.phase << "/" << MAX_PHASE << "\n"
+         << "Final evaluation: " << (board.whiteToMove ? score : -score) << " (white side)\n";
+    if (nnueNet) {
+        int nnueScore = NnueEvaluate(board);
+        cout << "NNUE evaluation: " << (board.whiteToMove ? nnueScore : -nnueScore) << " (white side, " << nnueKernel << ")\n";
+    }
+    cout << flush;
+}
+
+// Every piece of both sides attacking sq with the given occupancy, sliders see through removed pieces
+uint64_t AttackersTo(const Board& board, int sq, uint64_t occupied) {
+    return (pawnAttacks[BLACK][sq] & board.bitboard(WHITE, PAWN))
+         | (pawnAttacks[WHITE][sq] & board.bitboard(BLACK, PAWN))
+         | (knightAttacks[sq] & (board.bitboard(WHITE, KNIGHT) | board.bitboard(BLACK, KNIGHT)))
+         | (kingAttacks[sq] & (board.bitboard(WHITE, KING) | board.bitboard(BLACK, KING)))
+         | (BishopAttacks(sq, occupied) & (board.bitboard(WHITE, BISHOP) | board.bitboard(BLACK, BISHOP) | board.bitboard(WHITE, QUEEN) | board.bitboard(BLACK, QUEEN)))
+         | (RookAttacks(sq, occupied) & (board.bitboard(WHITE, ROOK) | board.bitboard(BLACK, ROOK) | board.bitboard(WHITE, QUEEN) | board.bitboard(BLACK, QUEEN)));
+}
+
+// Static exchange evaluation: true if the capture sequence on the move's target square, each side
+// recapturing with its least valuable attacker and free to stop, gains at least threshold.
+// X-ray attackers behind a recapturing piece join as it leaves the board. Pins are ignored
+bool SEE(const Board& board, Move move, int threshold) {
+    if (move.type() != NORMAL) return 0 >= threshold; // promotions, en passant and castling count as even
+
+    int from = move.from(), to = move.to();
+    int balance = pieceValues[board.pieceOn(to)] - threshold;
+    if (balance < 0) return false;
+    balance = pieceValues[board.pieceOn(from)] - balance;
+    if (balance <= 0) return true;
+
+    uint64_t occupied = board.allPieces ^ bitMasks[from] ^ bitMasks[to];
+    uint64_t attackers = AttackersTo(board, to, occupied);
+    uint64_t diagonal = board.bitboard(WHITE, BISHOP) | board.bitboard(BLACK, BISHOP) | board.bitboard(WHITE, QUEEN) | board.bitboard(BLACK, QUEEN);
+    uint64_t straight = board.bitboard(WHITE, ROOK) | board.bitboard(BLACK, ROOK) | board.bitboard(WHITE, QUEEN) | board.bitboard(BLACK, QUEEN);
+    int side = board.whiteToMove ? WHITE : BLACK;
+    bool result = true;
+
+    while (true) {
+        side ^= 1;
+        attackers &= occupied;
+        uint64_t sideAttackers = attackers & (side == WHITE ? board.occupancy[WHITE] : board.occupancy[BLACK]);
+        if (!sideAttackers) break;
+        result = !result;
+
+        // Least valuable attacker of the side to recapture
+        Piece piece = PAWN;
+        uint64_t candidates = 0;
+        for (; piece <= KING; piece = (Piece)(piece + 1)) {
+            candidates = sideAttackers & board.bitboard(side, piece);
+            if (candidates) break;
+        }
+
+        if (piece == KING) {
+            // The king may only recapture if the square is no longer defended
+            return (attackers & ~sideAttackers) ? !result : result;
+        }
+
+        balance = pieceValues[piece] - balance;
+        if (balance < (int)result) break;
+
+        occupied ^= candidates & -candidates;
+        if (piece == PAWN || piece == BISHOP || piece == QUEEN) attackers |= BishopAttacks(to, occupied) & diagonal;
+        if (piece == ROOK || piece == QUEEN) attackers |= RookAttacks(to, occupied) & straight;
+    }
+    return result;
+}
+
+inline uint64_t ReadBigEndian(const uint8_t* bytes, int size) {
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++) value = value << 8 | bytes[i];
+    return value;
+}
+
+inline void WriteBigEndian(uint8_t* bytes, uint64_t value, int size) {
+    for (int i = size - 1; i >= 0; i--, value >>= 8) bytes[i] = (uint8_t)value;
+}
+
+// Win/draw/loss bitbases for endings with few pieces, built by genbitbase. A table covers one material set,
+// the stronger side's king and pieces followed by the weaker side's, each side's pieces in the order Q R B N P.
+// The stronger side plays White in the table; when Black is stronger the position is probed flipped vertically
+// with the colors swapped. Positions are indexed by the relative side to move and every piece's square, with
+// the strong king mirrored onto files a-d, and take 2 bits each
+enum BitbaseValue : uint8_t {
+    BB_DRAW, BB_WIN, BB_LOSS, BB_INVALID // for the side to move
+};
+
+constexpr int BITBASE_MAX_PIECES = 4; // kings included
+constexpr int BITBASE_HEADER_SIZE = 16; // "NBB1", material key, piece count, padding
+constexpr int BITBASE_WIN = 20000; // above any evaluation, below the mate scores
+constexpr Piece bitbaseOrder[5] = {QUEEN, ROOK, BISHOP, KNIGHT, PAWN};
+
+// One side's non-king pieces as 4-bit counts in bitbaseOrder, queens in the top nibble.
+// A material key is the stronger side's signature shifted up 32 bits over the weaker side's
+inline int SignatureValue(uint32_t signature) {
+    int value = 0;
+    for (int kind = 4; kind >= 0; kind--, signature >>= 4) value += (signature & 15) * pieceValues[bitbaseOrder[kind]];
+    return value;
+}
+
+inline uint64_t CanonicalMaterial(uint32_t a, uint32_t b) {
+    int valueA = SignatureValue(a), valueB = SignatureValue(b);
+    if (valueB > valueA || (valueB == valueA && b > a)) swap(a, b);
+    return (uint64_t)a << 32 | b;
+}
+
+string MaterialName(uint64_t key) {
+    string name;
+    for (uint32_t signature : {(uint32_t)(key >> 32), (uint32_t)key}) {
+        name += 'K';
+        for (int kind = 0; kind < 5; kind++)
+            name.append((signature >> (4 * (4 - kind))) & 15, "QRBNP"[kind]);
+    }
+    return name;
+}
+
+// "KQKR" and the like, either side first. Fails on anything that is not a table genbitbase can build
+bool ParseMaterial(string_view name, uint64_t& key) {
+    uint32_t signature[2] = {0, 0};
+    int side = -1, pieces = 0;
+    for (char c : name) {
+        c = (char)toupper(c);
+        size_t kind = string_view("QRBNP").find(c);
+        if (c == 'K' && side < 1) side++;
+        else if (kind != string_view::npos && side >= 0) signature[side] += 1 << (4 * (4 - kind));
+        else return false;
+        pieces++;
+    }
+    if (side != 1 || pieces < 3 || pieces > BITBASE_MAX_PIECES) return false;
+    key = CanonicalMaterial(signature[0], signature[1]);
+    return true;
+}
+
+struct Bitbase {
+    uint64_t key = 0;
+    int pieceCount = 0;
+    int sides[BITBASE_MAX_PIECES]; // 0 for the stronger side
+    Piece pieces[BITBASE_MAX_PIECES];
+    const uint8_t* data = nullptr;
+    vector<uint8_t> owned; // a table built by this process, tables read from disk are mapped instead
+    const uint8_t* mapping = nullptr;
+    size_t mappingSize = 0;
+
+    explicit Bitbase(uint64_t materialKey) : key(materialKey) {
+        for (int side = 0; side < 2; side++) {
+            uint32_t signature = (uint32_t)(side == 0 ? key >> 32 : key);
+            sides[pieceCount] = side;
+            pieces[pieceCount++] = KING;
+            for (int kind = 0; kind < 5; kind++) {
+                for (uint32_t n = (signature >> (4 * (4 - kind))) & 15; n > 0; n--) {
+                    sides[pieceCount] = side;
+                    pieces[pieceCount++] = bitbaseOrder[kind];
+                }
+            }
+        }
+    }
+
+    ~Bitbase() {
+#ifdef __linux__
+        if (mapping) munmap((void*)mapping, mappingSize);
+#endif
+    }
+
+    size_t positions() const { return (size_t)64 << (6 * (pieceCount - 1)); }
+
+    size_t Index(int stm, const int squares[]) const {
+        int flip = (squares[0] & 7) >= 4 ? 7 : 0;
+        int king = squares[0] ^ flip;
+        size_t index = (size_t)stm * 32 + (king >> 3) * 4 + (king & 3);
+        for (int i = 1; i < pieceCount; i++) index = index * 64 + (squares[i] ^ flip);
+        return index;
+    }
+
+    // Squares of the position at index, returns the relative side to move
+    int Decode(size_t index, int squares[]) const {
+        for (int i = pieceCount - 1; i > 0; i--, index >>= 6) squares[i] = (int)(index & 63);
+        squares[0] = (int)((index & 31) / 4 * 8 + (index & 3));
+        return (int)(index >> 5);
+    }
+
+    int Get(size_t index) const {
+        return (data[index >> 2] >> (2 * (index & 3))) & 3;
+    }
+};
+
+class Bitbases {
+public:
+    void Clear() {
+        tables.clear();
+        maxPieces = 0;
+    }
+
+    void Add(unique_ptr<Bitbase> table) {
+        maxPieces = max(maxPieces, table->pieceCount);
+        tables.push_back(std::move(table));
+    }
+
+    const Bitbase* Find(uint64_t key) const {
+        for (const auto& table : tables)
+            if (table->key == key) return table.get();
+        return nullptr;
+    }
+
+    // Maps <dir>/<material>.nbb for every material set that has a file, returns how many were loaded
+    int LoadDirectory(const string& dir, const vector<uint64_t>& materials) {
+        Clear();
+#ifdef __linux__
+        for (uint64_t key : materials) {
+            auto table = make_unique<Bitbase>(key);
+            size_t expected = BITBASE_HEADER_SIZE + table->positions() / 4;
+            int fd = open((dir + "/" + MaterialName(key) + ".nbb").c_str(), O_RDONLY);
+            if (fd < 0) continue;
+            struct stat info;
+            if (fstat(fd, &info) == 0 && (size_t)info.st_size == expected) {
+                void* mapped = mmap(nullptr, expected, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    table->mapping = (const uint8_t*)mapped;
+                    table->mappingSize = expected;
+                }
+            }
+            close(fd);
+            if (!table->mapping) continue;
+            if (memcmp(table->mapping, "NBB1", 4) != 0 || ReadBigEndian(table->mapping + 4, 8) != key) {
+                cerr << "[Warning] " << dir << "/" << MaterialName(key) << ".nbb is not a bitbase for that material" << endl;
+                continue;
+            }
+            table->data = table->mapping + BITBASE_HEADER_SIZE;
+            Add(std::move(table));
+        }
+#endif
+        return (int)tables.size();
+    }
+
+    // Exact result for the side to move, false when no table covers the position. Positions with castling
+    // rights or a possible en passant capture are left to the search, the tables assume neither
+    bool Probe(const Board& board, int& value) const {
+        int count = __builtin_popcountll(board.allPieces);
+        if (count > maxPieces || board.castlingRights) return false;
+        if (board.hasEnPassant()) {
+            int us = board.whiteToMove ? WHITE : BLACK;
+            if (pawnAttacks[us ^ 1][board.getEnPassantTarget()] & board.bitboard(us, PAWN)) return false;
+        }
+        if (count == 2) {
+            value = BB_DRAW;
+            return true;
+        }
+
+        uint32_t signature[2] = {0, 0};
+        for (int color = 0; color < 2; color++)
+            for (Piece kind : bitbaseOrder)
+                signature[color] = signature[color] << 4 | __builtin_popcountll(board.bitboard(color, kind));
+        uint64_t key = CanonicalMaterial(signature[WHITE], signature[BLACK]);
+        int strong = key == ((uint64_t)signature[WHITE] << 32 | signature[BLACK]) ? WHITE : BLACK;
+        const Bitbase* table = Find(key);
+        if (!table) return false;
+
+        int flip = strong == BLACK ? 56 : 0;
+        int squares[BITBASE_MAX_PIECES] = {};
+        uint64_t taken = 0;
+        for (int i = 0; i < table->pieceCount; i++) {
+            int color = table->sides[i] == 0 ? strong : strong ^ 1;
+            int sq = __builtin_ctzll(board.bitboard(color, table->pieces[i]) & ~taken);
+            taken |= bitMasks[sq];
+            squares[i] = sq ^ flip;
+        }
+        int stm = (board.whiteToMove ? WHITE : BLACK) == strong ? 0 : 1;
+        value = table->Get(table->Index(stm, squares));
+        return value != BB_INVALID;
+    }
+
+    int maxPieces = 0; // no probe is tried on positions with more pieces
+
+private:
+    vector<unique_ptr<Bitbase>> tables;
+};
+
+Bitbases bitbases;
+
+inline int SignaturePieces(uint32_t signature) {
+    int pieces = 0;
+    for (; signature; signature >>= 4) pieces += signature & 15;
+    return pieces;
+}
+
+// Every material set of at most maxPieces pieces in which some side has more than its king, ordered so the
+// sets a capture or promotion leads to come first: fewer pieces, then fewer pawns
+vector<uint64_t> BitbaseMaterials(int maxPieces) {
+    vector<uint32_t> signatures;
+    for (uint32_t signature = 0; signature < 1u << 20; signature++)
+        if (SignaturePieces(signature) <= maxPieces - 2) signatures.push_back(signature);
+    vector<uint64_t> materials;
+    for (uint32_t a : signatures)
+        for (uint32_t b : signatures)
+            if ((a | b) && SignaturePieces(a) + SignaturePieces(b) <= maxPieces - 2) materials.push_back(CanonicalMaterial(a, b));
+    auto order = [](uint64_t key) {
+        return make_pair(SignaturePieces((uint32_t)(key >> 32)) + SignaturePieces((uint32_t)key), (key >> 32 & 15) + (key & 15));
+    };
+    sort(materials.begin(), materials.end(), [&](uint64_t a, uint64_t b) { return order(a) != order(b) ? order(a) < order(b) : a < b; });
+    materials.erase(unique(materials.begin(), materials.end()), materials.end());
+    return materials;
+}
+
+// Every won bitbase position scores about the same, so the winning side is steered by material, pawn advance,
+// the losing king's distance from the center and the distance between the kings until the search sees the mate
+int BitbaseScore(const Board& board, int value) {
+    if (value == BB_DRAW) return 0;
+    int us = board.whiteToMove ? WHITE : BLACK;
+    int winner = value == BB_WIN ? us : us ^ 1;
+    int progress = 0;
+    for (int piece = PAWN; piece <= QUEEN; piece++)
+        progress += pieceValues[piece] * (__builtin_popcountll(board.bitboard(winner, (Piece)piece))
+                                          - __builtin_popcountll(board.bitboard(winner ^ 1, (Piece)piece)));
+    for (uint64_t pawns = board.bitboard(winner, PAWN); pawns; pawns &= pawns - 1) {
+        int rank = __builtin_ctzll(pawns) >> 3;
+        progress += 20 * (winner == WHITE ? rank : 7 - rank);
+    }
+    int loserKing = winner == WHITE ? board.kingSq[BLACK] : board.kingSq[WHITE];
+    int winnerKing = winner == WHITE ? board.kingSq[WHITE] : board.kingSq[BLACK];
+    int file = loserKing & 7, rank = loserKing >> 3;
+    progress += 10 * (max(3 - file, file - 4) + max(3 - rank, rank - 4));
+    progress -= 5 * max(abs(file - (winnerKing & 7)), abs(rank - (winnerKing >> 3)));
+    return value == BB_WIN ? BITBASE_WIN + progress : -BITBASE_WIN - progress;
+}
+
+// Move ordering. Butterfly history is bounded by MAX_HISTORY so scores fit the 16-bit ordering slot
+constexpr int MAX_HISTORY = 16384;
+
+enum PickStage {
+    STAGE_HASH, STAGE_GEN_NOISY, STAGE_GOOD_NOISY, STAGE_KILLER1, STAGE_KILLER2, STAGE_COUNTER,
+    STAGE_GEN_QUIET, STAGE_QUIET, STAGE_BAD_NOISY, STAGE_DONE
+};
+
+inline bool IsQuiet(const Board& board, Move move) {
+    return board.pieceOn(move.to()) == EMPTY && move.type() != PROMOTION && move.type() != EN_PASSANT;
+}
+
+// Hands out moves one stage at a time: hash move, captures and queen promotions by MVV-LVA that do
+// not lose material by SEE, the two killers, the countermove, quiets by history, then the losing
+// captures and underpromotions. A stage is only generated when everything before it failed to cut off
+class MovePicker {
+public:
+    MovePicker(Board& board, Move ttMove, const Move killers[2], Move counter, const int16_t (*history)[64])
+        : board(board), ttMove(ttMove), killer1(killers[0]), killer2(killers[1]), counter(counter), history(history) {
+        ci = ComputeCheckInfo(board, board.whiteToMove ? WHITE : BLACK);
+    }
+
+    // Quiescence: only the winning and even noisy moves, or every evasion when in check
+    explicit MovePicker(Board& board) : MovePicker(board, NO_MOVE, noKillers, NO_MOVE, emptyHistory) {
+        quiescence = !ci.checkers;
+    }
+
+    Move Next() {
+        switch (stage) {
+            case STAGE_HASH:
+                stage++;
+                if (IsLegalMove(board, ci, ttMove)) return ttMove;
+                [[fallthrough]];
+            case STAGE_GEN_NOISY:
+                GenerateMoves(board, ci, GEN_NOISY, noisy);
+                ScoreNoisy();
+                stage++;
+                [[fallthrough]];
+            case STAGE_GOOD_NOISY:
+                while (noisyIndex < noisy.count) {
+                    Move move = PickBest(noisy, noisyIndex++).move;
+                    if (move == ttMove) continue;
+                    // SEE only for the move about to be tried, most nodes cut off before the rest
+                    if ((move.isPromotion() && move.promotion() != QUEEN) || !SEE(board, move, 0)) {
+                        badNoisy.add(move);
+                        continue;
+                    }
+                    return move;
+                }
+                if (quiescence) return NO_MOVE;
+                stage++;
+                [[fallthrough]];
+            case STAGE_KILLER1:
+                stage++;
+                if (killer1 != ttMove && IsQuiet(board, killer1) && IsLegalMove(board, ci, killer1)) return killer1;
+                [[fallthrough]];
+            case STAGE_KILLER2:
+                stage++;
+                if (killer2 != ttMove && killer2 != killer1 && IsQuiet(board, killer2) && IsLegalMove(board, ci, killer2)) return killer2;
+                [[fallthrough]];
+            case STAGE_COUNTER:
+                stage++;
+                if (counter != ttMove && counter != killer1 && counter != killer2
+                    && IsQuiet(board, counter) && IsLegalMove(board, ci, counter)) return counter;
+                [[fallthrough]];
+            case STAGE_GEN_QUIET:
+                GenerateMoves(board, ci, GEN_QUIET, quiets);
+                for (ScoredMove& m : quiets) m.score = history[m.move.from()][m.move.to()];
+                stage++;
+                [[fallthrough]];
+            case STAGE_QUIET:
+                while (quietIndex < quiets.count) {
+                    Move move = PickBest(quiets, quietIndex).move;
+                    quietIndex++;
+                    if (move != ttMove && move != killer1 && move != killer2 && move != counter) return move;
+                }
+                stage++;
+                [[fallthrough]];
+            case STAGE_BAD_NOISY:
+                if (badIndex < badNoisy.count) return badNoisy[badIndex++];
+                stage++;
+                [[fallthrough]];
+            default:
+                return NO_MOVE;
+        }
+    }
+
+    CheckInfo ci;
+
+private:
+    // MVV-LVA, a promotion counts as capturing the promoted piece
+    void ScoreNoisy() {
+        for (ScoredMove& m : noisy) {
+            Piece attacker = board.pieceOn(m.move.from());
+            Piece victim = m.move.isEnPassant() ? PAWN : board.pieceOn(m.move.to());
+            int score = 8 * victim - attacker;
+            if (m.move.isPromotion()) score += 8 * (m.move.promotion() - PAWN);
+            m.score = (int16_t)score;
+        }
+    }
+
+    // One step of selection sort: moves the best remaining entry to index
+    static ScoredMove& PickBest(MoveList& list, int index) {
+        int best = index;
+        for (int i = index + 1; i < list.count; i++) {
+            if (list.moves[i].score > list.moves[best].score) best = i;
+        }
+        swap(list.moves[index], list.moves[best]);
+        return list.moves[index];
+    }
+
+    Board& board;
+    Move ttMove, killer1, killer2, counter;
+    const int16_t (*history)[64];
+    int stage = STAGE_HASH;
+    bool quiescence = false;
+    MoveList noisy, quiets, badNoisy;
+    int noisyIndex = 0, quietIndex = 0, badIndex = 0;
+
+    static constexpr Move noKillers[2] = {NO_MOVE, NO_MOVE};
+    static const int16_t emptyHistory[64][64];
+};
+
+const int16_t MovePicker::emptyHistory[64][64] = {};
+
+mutex outputMutex;
+
+// Writes one whole line, searches of different games print concurrently in server mode
+void EmitLine(const string& line) {
+    lock_guard<mutex> lock(outputMutex);
+    cout << line << endl;
+}
+
+struct SearchLimits {
+    int64_t time[2] = {-1, -1}; // wtime, btime in ms, -1 when not given
+    int64_t inc[2] = {0, 0};
+    int64_t movetime = -1;
+    int movestogo = 0;
+    int depth = MAX_SEARCH_PLY - 1;
+    uint64_t nodes = 0; // 0 = unlimited
+    bool infinite = false;
+    bool ponder = false; // searching the predicted reply on the opponent's clock until ponderhit or stop
+    bool quiet = false; // no info lines, for batch and benchmark searches
+};
+
+struct SearchResult {
+    Move move = NO_MOVE;
+    Move ponder = NO_MOVE; // expected reply, NO_MOVE if the search has none
+    int score = 0;
+    int depth = 0;
+    uint64_t nodes = 0;
+    int64_t timeMs = 0;
+    EngineStats stats; // summed over the search threads
+};
+
+// Reads the arguments of a "go" line
+SearchLimits ParseGoLimits(const string& line) {
+    SearchLimits limits;
+    istringstream iss(line);
+    string token;
+    iss >> token;
+    while (iss >> token) {
+        if (token == "wtime") iss >> limits.time[WHITE];
+        else if (token == "btime") iss >> limits.time[BLACK];
+        else if (token == "winc") iss >> limits.inc[WHITE];
+        else if (token == "binc") iss >> limits.inc[BLACK];
+        else if (token == "movetime") iss >> limits.movetime;
+        else if (token == "movestogo") iss >> limits.movestogo;
+        else if (token == "depth") iss >> limits.depth;
+        else if (token == "nodes") iss >> limits.nodes;
+        else if (token == "infinite") limits.infinite = true;
+        else if (token == "ponder") limits.ponder = true;
+    }
+    limits.depth = max(1, min(limits.depth, MAX_SEARCH_PLY - 1));
+    return limits;
+}
+
+// Mate scores are stored relative to the node, not the root, so they stay valid at any ply
+int ScoreToTT(int score, int ply) {
+    return score >= MATE_BOUND ? score + ply : score <= -MATE_BOUND ? score - ply : score;
+}
+
+int ScoreFromTT(int score, int ply) {
+    return score >= MATE_BOUND ? score - ply : score <= -MATE_BOUND ? score + ply : score;
+}
+
+string ScoreToUci(int score) {
+    if (score >= MATE_BOUND) return "mate " + to_string((MATE_SCORE - score + 1) / 2);
+    if (score <= -MATE_BOUND) return "mate -" + to_string((MATE_SCORE + score) / 2);
+    return "cp " + to_string(score);
+}
+
+class Search;
+
+// State shared by every thread of one search. Only the main thread checks the clock; helpers
+// poll the stop flag, which the main thread raises when it finishes or runs out of time.
+// stop and ponderhit may also arrive from the command loop while the search runs
+struct SearchShared {
+    SearchLimits limits;
+    chrono::high_resolution_clock::time_point startTime;
+    int64_t softLimitMs = -1, hardLimitMs = -1;
+    atomic<bool> stop{false};
+    atomic<bool> pondering{false}; // time limits are ignored until ponderhit
+    atomic<bool> stopOnPonderhit{false}; // the budget ran out while pondering
+    vector<Search*> threads;
+    string outputTag; // prepended to every line the search prints, "game <id> " in server mode
+    vector<pair<int64_t, Move>>* iterations = nullptr; // when set, the main thread logs each completed depth's time and move
+
+    SearchShared(const SearchLimits& limits, bool whiteToMove) : limits(limits), pondering(limits.ponder) {
+        startTime = chrono::high_resolution_clock::now();
+        AllocateTime(whiteToMove ? WHITE : BLACK);
+    }
+
+    int64_t ElapsedMs() const {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - startTime).count();
+    }
+
+    bool TimeLimited() const {
+        return !limits.infinite && !pondering.load(memory_order_relaxed);
+    }
+
+    // The predicted reply was played: the search continues on our clock, counting the time already
+    // spent pondering, and answers at once if it would have stopped meanwhile
+    void PonderHit() {
+        if (stopOnPonderhit.load(memory_order_relaxed)) stop.store(true, memory_order_relaxed);
+        pondering.store(false, memory_order_release);
+    }
+
+    uint64_t TotalNodes() const;
+
+private:
+    // Budgets for this move: the soft limit stops deepening, the hard limit aborts the search
+    void AllocateTime(int side) {
+        if (limits.movetime >= 0) {
+            softLimitMs = hardLimitMs = max<int64_t>(1, limits.movetime - MOVE_OVERHEAD_MS);
+        } else if (limits.time[side] >= 0) {
+            int64_t left = max<int64_t>(1, limits.time[side] - MOVE_OVERHEAD_MS);
+            int movesToGo = limits.movestogo > 0 ? min(limits.movestogo, 50) : 30;
+            softLimitMs = min(left, left / movesToGo + limits.inc[side] * 3 / 4);
+            hardLimitMs = min(left, softLimitMs * 4);
+        }
+    }
+};
+
+// Helper threads skip some depths so they do not all search the same tree in lockstep (lazy SMP)
+constexpr int skipSize[20] = {1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4};
+constexpr int skipPhase[20] = {0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7};
+
+// Move ordering statistics and the pawn hash of one search thread. They outlive the search, so the next
+// move and a search restarted after a ponder miss begin with what earlier searches learned
+struct SearchHistory {
+    Move counterMoves[7][64] = {}; // indexed by the piece and destination of the previous move
+    int16_t history[2][64][64] = {}; // butterfly history by side, from and to
+    PawnTable pawns;
+};
+
+// One search thread with its own board copy and search stack
+class Search {
+public:
+    Search(const Board& position, SearchShared& shared, SearchHistory& stats, int id)
+        : board(position), shared(shared), limits(shared.limits), id(id),
+          counterMoves(stats.counterMoves), history(stats.history), pawns(stats.pawns) {}
+
+    // Deepens until a limit is hit, keeping the best move of the last completed iteration
+    void Run() {
+        MoveList rootMoves;
+        GenerateLegalMoves(board, rootMoves);
+        if (rootMoves.empty()) return;
+        bestMove = rootMoves[0];
+
+        // From a root inside a bitbase every probe would only repeat the root's result, so probes cut the
+        // search only once material came off and the search itself has to find how to convert
+        int rootValue;
+        probePieces = bitbases.Probe(board, rootValue) ? __builtin_popcountll(board.allPieces) - 1 : bitbases.maxPieces;
+
+        int score = 0;
+        for (int depth = 1; depth <= limits.depth && !stopped; depth++) {
+            if (id > 0) {
+                int i = (id - 1) % 20;
+                if (((depth + skipPhase[i]) / skipSize[i]) % 2) continue;
+            }
+            rootDepth = depth;
+            int delta = 25;
+            int alpha = -INF_SCORE, beta = INF_SCORE;
+            if (depth >= 4) {
+                alpha = max(score - delta, -INF_SCORE);
+                beta = min(score + delta, INF_SCORE);
+            }
+
+            // Aspiration window around the previous score, widened on the failing side until it holds
+            while (true) {
+                int result = Negamax(depth, alpha, beta, 0);
+                if (stopped) break;
+                if (result <= alpha) {
+                    beta = (alpha + beta) / 2;
+                    alpha = max(result - delta, -INF_SCORE);
+                } else if (result >= beta) {
+                    beta = min(result + delta, INF_SCORE);
+                } else {
+                    score = result;
+                    break;
+                }
+                delta *= 2;
+                if (delta > 1000) alpha = -INF_SCORE, beta = INF_SCORE;
+            }
+            if (stopped) break;
+
+            bestMove = pv[0][0];
+            ponderMove = pvLength[0] > 1 ? pv[0][1] : NO_MOVE;
+            bestScore = score;
+            completedDepth = depth;
+            if (id != 0) continue;
+
+            if (shared.iterations) shared.iterations->push_back({shared.ElapsedMs(), bestMove});
+
+            if (!limits.quiet) PrintInfo(depth, score);
+            if (!limits.infinite && shared.softLimitMs >= 0 && shared.ElapsedMs() >= shared.softLimitMs * 6 / 10) {
+                if (!shared.pondering.load(memory_order_relaxed)) break;
+                shared.stopOnPonderhit.store(true, memory_order_relaxed);
+            }
+            if (abs(score) >= MATE_BOUND && depth > MATE_SCORE - abs(score)) break;
+        }
+        if (id != 0) return;
+
+        // A ponder search may not answer before ponderhit or stop, even when it has nothing left to search
+        while (shared.pondering.load(memory_order_acquire) && !shared.stop.load(memory_order_relaxed))
+            this_thread::sleep_for(chrono::milliseconds(1));
+        shared.stop.store(true, memory_order_relaxed);
+    }
+
+    atomic<uint64_t> nodes{0}; // written by this thread only, read by the main thread for totals
+    EngineStats stats; // what this thread counted during the search, set once Run returned
+    Move bestMove = NO_MOVE;
+    Move ponderMove = NO_MOVE;
+    int bestScore = 0;
+    int completedDepth = 0;
+
+private:
+    int Negamax(int depth, int alpha, int beta, int ply) {
+        pvLength[ply] = ply;
+        if (depth <= 0) return Quiescence(alpha, beta, ply);
+        nodes.store(nodes.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        STAT_COUNT(nodes);
+
+        if (id == 0 && (nodes.load(memory_order_relaxed) & 2047) == 0) CheckLimits();
+        if (shared.stop.load(memory_order_relaxed)) stopped = true;
+        if (stopped) return 0;
+
+        bool root = ply == 0;
+        if (!root) {
+            if (board.IsFiftyMoveDraw() || board.IsRepetition()) return 0;
+            if (ply >= MAX_SEARCH_PLY - 1) return Evaluate(board, &pawns);
+            int bitbaseValue;
+            if (__builtin_popcountll(board.allPieces) <= probePieces && bitbases.Probe(board, bitbaseValue))
+                return BitbaseScore(board, bitbaseValue);
+        }
+
+        bool pvNode = beta - alpha > 1;
+        TTData tte;
+        Move ttMove = NO_MOVE;
+        STAT_COUNT(ttProbes);
+        if (TT.probe(board.zobristKey, tte)) {
+            STAT_COUNT(ttHits);
+            ttMove = tte.move;
+            int ttScore = ScoreFromTT(tte.score, ply);
+            if (!pvNode && tte.depth >= depth
+                && (tte.bound == BOUND_EXACT
+                    || (tte.bound == BOUND_LOWER && ttScore >= beta)
+                    || (tte.bound == BOUND_UPPER && ttScore <= alpha))) {
+                return ttScore;
+            }
+        }
+
+        Move prev = board.history.empty() ? NO_MOVE : board.history.back().move;
+        Move counter = prev != NO_MOVE ? counterMoves[board.pieceOn(prev.to())][prev.to()] : NO_MOVE;
+        int side = board.whiteToMove ? WHITE : BLACK;
+        MovePicker picker(board, ttMove, killers[ply], counter, history[side]);
+
+        int bestScore = -INF_SCORE;
+        Move bestMove = NO_MOVE;
+        int originalAlpha = alpha;
+        int movesSearched = 0;
+        Move quietsTried[64];
+        int quietCount = 0;
+
+        for (Move move = picker.Next(); move != NO_MOVE; move = picker.Next()) {
+            bool quiet = IsQuiet(board, move);
+            board.make_move(move);
+            int score;
+            if (movesSearched == 0) {
+                score = -Negamax(depth - 1, -beta, -alpha, ply + 1);
+            } else {
+                score = -Negamax(depth - 1, -alpha - 1, -alpha, ply + 1);
+                if (score > alpha && score < beta) score = -Negamax(depth - 1, -beta, -alpha, ply + 1);
+            }
+            board.unmake_move();
+            if (stopped) return 0;
+            movesSearched++;
+
+            if (score > bestScore) {
+                bestScore = score;
+                if (score > alpha) {
+                    alpha = score;
+                    bestMove = move;
+                    pv[ply][ply] = move;
+                    for (int next = ply + 1; next < pvLength[ply + 1]; next++) pv[ply][next] = pv[ply + 1][next];
+                    pvLength[ply] = pvLength[ply + 1];
+                    if (alpha >= beta) {
+                        STAT_COUNT(cutoffs[min(movesSearched, CUTOFF_SLOTS) - 1]);
+                        if (quiet) UpdateQuietStats(move, prev, side, ply, depth, quietsTried, quietCount);
+                        break;
+                    }
+                }
+            }
+            if (quiet && quietCount < 64) quietsTried[quietCount++] = move;
+        }
+
+        if (movesSearched == 0) return picker.ci.checkers ? -MATE_SCORE + ply : 0;
+
+        Bound bound = bestScore >= beta ? BOUND_LOWER : bestScore > originalAlpha ? BOUND_EXACT : BOUND_UPPER;
+        TT.store(board.zobristKey, depth, ScoreToTT(bestScore, ply), bound, bestMove);
+        return bestScore;
+    }
+
+    // Resolves captures until the position is quiet. The side to move may stand pat on the static
+    // evaluation; captures that lose material by SEE or cannot lift the score near alpha are skipped
+    int Quiescence(int alpha, int beta, int ply) {
+        pvLength[ply] = ply;
+        nodes.store(nodes.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        STAT_COUNT(qnodes);
+        if (id == 0 && (nodes.load(memory_order_relaxed) & 2047) == 0) CheckLimits();
+        if (shared.stop.load(memory_order_relaxed)) stopped = true;
+        if (stopped) return 0;
+        if (ply >= MAX_SEARCH_PLY - 1) return Evaluate(board, &pawns);
+
+        MovePicker picker(board);
+        bool inCheck = picker.ci.checkers != 0;
+        int standPat = inCheck ? -INF_SCORE : Evaluate(board, &pawns);
+        if (standPat >= beta) return standPat;
+        alpha = max(alpha, standPat);
+
+        int bestScore = standPat;
+        int movesSearched = 0;
+        for (Move move = picker.Next(); move != NO_MOVE; move = picker.Next()) {
+            if (!inCheck && !move.isPromotion()) {
+                Piece victim = move.isEnPassant() ? PAWN : board.pieceOn(move.to());
+                if (standPat + pieceValues[victim] + DELTA_MARGIN <= alpha) continue;
+            }
+
+            board.make_move(move);
+            int score = -Quiescence(-beta, -alpha, ply + 1);
+            board.unmake_move();
+            if (stopped) return 0;
+            movesSearched++;
+
+            if (score > bestScore) {
+                bestScore = score;
+                if (score > alpha) {
+                    alpha = score;
+                    pv[ply][ply] = move;
+                    for (int next = ply + 1; next < pvLength[ply + 1]; next++) pv[ply][next] = pv[ply + 1][next];
+                    pvLength[ply] = pvLength[ply + 1];
+                    if (alpha >= beta) break;
+                }
+            }
+        }
+
+        if (inCheck && movesSearched == 0) return -MATE_SCORE + ply;
+        return bestScore;
+    }
+
+    // A quiet move caused a cutoff: it becomes a killer and the countermove to the previous move,
+    // its history rises and the quiets searched before it are penalized
+    void UpdateQuietStats(Move move, Move prev, int side, int ply, int depth, const Move* tried, int triedCount) {
+        if (killers[ply][0] != move) {
+            killers[ply][1] = killers[ply][0];
+            killers[ply][0] = move;
+        }
+        if (prev != NO_MOVE) counterMoves[board.pieceOn(prev.to())][prev.to()] = move;
+
+        int bonus = min(depth * depth, 1200);
+        UpdateHistory(history[side][move.from()][move.to()], bonus);
+        for (int i = 0; i < triedCount; i++) UpdateHistory(history[side][tried[i].from()][tried[i].to()], -bonus);
+    }
+
+    // Gravity update, the entry saturates at +-MAX_HISTORY
+    static void UpdateHistory(int16_t& entry, int bonus) {
+        entry += bonus - entry * abs(bonus) / MAX_HISTORY;
+    }
+
+    void CheckLimits() {
+        if (limits.nodes && shared.TotalNodes() >= limits.nodes) stopped = true;
+        if (rootDepth > 1 && shared.TimeLimited() && shared.hardLimitMs >= 0 && shared.ElapsedMs() >= shared.hardLimitMs) stopped = true;
+        if (stopped) shared.stop.store(true, memory_order_relaxed);
+    }
+
+    void PrintInfo(int depth, int score) {
+        int64_t ms = shared.ElapsedMs();
+        uint64_t total = shared.TotalNodes();
+        ostringstream info;
+        info << shared.outputTag << "info depth " << depth << " score " << ScoreToUci(score) << " nodes " << total
+             << " nps " << total * 1000 / max<int64_t>(ms, 1) << " time " << ms
+             << " hashfull " << TT.hashfull() << " pv";
+        for (int i = 0; i < pvLength[0]; i++) info << " " << moveToString(pv[0][i]);
+        EmitLine(info.str());
+    }
+
+    Board board;
+    SearchShared& shared;
+    const SearchLimits& limits;
+    int id;
+    int rootDepth = 0;
+    int probePieces = 0; // bitbases are probed at or below this many pieces
+    bool stopped = false;
+
+    Move pv[MAX_SEARCH_PLY][MAX_SEARCH_PLY] = {};
+    int pvLength[MAX_SEARCH_PLY] = {};
+
+    // Move ordering statistics, per thread so helpers need no synchronization
+    Move killers[MAX_SEARCH_PLY][2] = {};
+    Move (&counterMoves)[7][64];
+    int16_t (&history)[2][64][64];
+    PawnTable& pawns;
+};
+
+uint64_t SearchShared::TotalNodes() const {
+    uint64_t total = 0;
+    for (const Search* thread : threads) total += thread->nodes.load(memory_order_relaxed);
+    return total;
+}
+
+int searchThreads = 1; // "Threads" option
+vector<unique_ptr<SearchHistory>> searchHistories; // per thread, for searches outside a game session
+
+void ClearSearchHistory(vector<unique_ptr<SearchHistory>>& histories) {
+    for (auto& stats : histories) *stats = SearchHistory{};
+}
+
+// Runs one search on threadCount threads sharing the transposition table and returns the result
+// of the thread that completed the deepest iteration (ties go to the better score).
+// histories holds one table per thread and is kept for the game's next search
+SearchResult SearchPosition(const Board& board, SearchShared& shared, vector<unique_ptr<SearchHistory>>& histories, int threadCount) {
+    while ((int)histories.size() < threadCount) histories.push_back(make_unique<SearchHistory>());
+    vector<unique_ptr<Search>> workers;
+    for (int i = 0; i < threadCount; i++) {
+        workers.push_back(make_unique<Search>(board, shared, *histories[i], i));
+        shared.threads.push_back(workers.back().get());
+    }
+    TT.newSearch();
+
+    auto run = [&workers](int i) {
+        EngineStats before = threadStats;
+        workers[i]->Run();
+        workers[i]->stats = threadStats - before;
+    };
+    vector<thread> helpers;
+    for (int i = 1; i < threadCount; i++) helpers.emplace_back(run, i);
+    run(0);
+    for (thread& t : helpers) t.join();
+
+    Search* best = workers[0].get();
+    for (auto& worker : workers) {
+        if (worker->bestMove == NO_MOVE) continue;
+        if (worker->completedDepth > best->completedDepth
+            || (worker->completedDepth == best->completedDepth && worker->bestScore > best->bestScore)) {
+            best = worker.get();
+        }
+    }
+
+    // Short PVs (hash cutoffs at the root's child) fall back to the hash move of the position after ours
+    Move ponder = best->ponderMove;
+    if (ponder == NO_MOVE && best->bestMove != NO_MOVE) {
+        Board next = board;
+        next.make_move(best->bestMove);
+        TTData tte;
+        if (TT.probe(next.zobristKey, tte) && tte.move != NO_MOVE
+            && IsLegalMove(next, ComputeCheckInfo(next, next.whiteToMove ? WHITE : BLACK), tte.move)) {
+            ponder = tte.move;
+        }
+    }
+    SearchResult result{best->bestMove, ponder, best->bestScore, best->completedDepth, shared.TotalNodes(), shared.ElapsedMs(), EngineStats{}};
+    for (auto& worker : workers) result.stats += worker->stats;
+    return result;
+}
+
+SearchResult SearchPosition(const Board& board, const SearchLimits& limits) {
+    SearchShared shared(limits, board.whiteToMove);
+    return SearchPosition(board, shared, searchHistories, searchThreads);
+}
+
+// Searches every perft suite position for a fixed time on 1, 2, 4 and 8 threads and reports
+// the NPS and average depth reached, to show how the search scales with cores
+void RunSmpBench(int64_t movetime) {
+    int configuredThreads = searchThreads;
+    double baseNps = 0;
+
+    for (int threads : {1, 2, 4, 8}) {
+        searchThreads = threads;
+        uint64_t nodes = 0;
+        int64_t ms = 0;
+        int depthSum = 0;
+        uint64_t pawnHits = 0, pawnProbes = 0;
+
+        for (const PerftPosition& position : perftSuite) {
+            TT.clear();
+            Board board;
+            board.setBB(position.fen);
+            SearchLimits limits;
+            limits.movetime = movetime + MOVE_OVERHEAD_MS;
+            limits.quiet = true;
+            for (auto& stats : searchHistories) stats->pawns.hits = stats->pawns.probes = 0;
+            SearchResult result = SearchPosition(board, limits);
+            for (auto& stats : searchHistories) pawnHits += stats->pawns.hits, pawnProbes += stats->pawns.probes;
+            nodes += result.nodes;
+            ms += result.timeMs;
+            depthSum += result.depth;
+        }
+
+        double nps = nodes * 1000.0 / max<int64_t>(ms, 1);
+        if (threads == 1) baseNps = nps;
+        cout << "threads " << threads << " nodes " << nodes << " nps " << (uint64_t)nps
+             << " speedup " << nps / max(baseNps, 1.0) << " avg depth " << (double)depthSum / perftSuite.size()
+             << " pawn hash hits " << 100.0 * pawnHits / max<uint64_t>(pawnProbes, 1) << "%\n" << flush;
+    }
+    searchThreads = configuredThreads;
+}
+
+// Opening book in the Polyglot .bin layout: 16-byte big-endian entries (key, move, weight, learn) sorted by key.
+// The key is Polyglot's: 781 published random numbers indexed by piece and square (768), castling rights (4),
+// en passant file (8) and side to move (1), so third-party books probe and buildbook's books open elsewhere
+constexpr uint64_t bookRandom[781] = {
+    0x9D39247E33776D41ULL, 0x2AF7398005AAA5C7ULL, 0x44DB015024623547ULL, 0x9C15F73E62A76AE2ULL,
+    0x75834465489C0C89ULL, 0x3290AC3A203001BFULL, 0x0FBBAD1F61042279ULL, 0xE83A908FF2FB60CAULL,
+    0x0D7E765D58755C10ULL, 0x1A083822CEAFE02DULL, 0x9605D5F0E25EC3B0ULL, 0xD021FF5CD13A2ED5ULL,
+    0x40BDF15D4A672E32ULL, 0x011355146FD56395ULL, 0x5DB4832046F3D9E5ULL, 0x239F8B2D7FF719CCULL,
+    0x05D1A1AE85B49AA1ULL, 0x679F848F6E8FC971ULL, 0x7449BBFF801FED0BULL, 0x7D11CDB1C3B7ADF0ULL,
+    0x82C7709E781EB7CCULL, 0xF3218F1C9510786CULL, 0x331478F3AF51BBE6ULL, 0x4BB38DE5E7219443ULL,
+    0xAA649C6EBCFD50FCULL, 0x8DBD98A352AFD40BULL, 0x87D2074B81D79217ULL, 0x19F3C751D3E92AE1ULL,
+    0xB4AB30F062B19ABFULL, 0x7B0500AC42047AC4ULL, 0xC9452CA81A09D85DULL, 0x24AA6C514DA27500ULL,
+    0x4C9F34427501B447ULL, 0x14A68FD73C910841ULL, 0xA71B9B83461CBD93ULL, 0x03488B95B0F1850FULL,
+    0x637B2B34FF93C040ULL, 0x09D1BC9A3DD90A94ULL, 0x3575668334A1DD3BULL, 0x735E2B97A4C45A23ULL,
+    0x18727070F1BD400BULL, 0x1FCBACD259BF02E7ULL, 0xD310A7C2CE9B6555ULL, 0xBF983FE0FE5D8244ULL,
+    0x9F74D14F7454A824ULL, 0x51EBDC4AB9BA3035ULL, 0x5C82C505DB9AB0FAULL, 0xFCF7FE8A3430B241ULL,
+    0x3253A729B9BA3DDEULL, 0x8C74C368081B3075ULL, 0xB9BC6C87167C33E7ULL, 0x7EF48F2B83024E20ULL,
+    0x11D505D4C351BD7FULL, 0x6568FCA92C76A243ULL, 0x4DE0B0F40F32A7B8ULL, 0x96D693460CC37E5DULL,
+    0x42E240CB63689F2FULL, 0x6D2BDCDAE2919661ULL, 0x42880B0236E4D951ULL, 0x5F0F4A5898171BB6ULL,
+    0x39F890F579F92F88ULL, 0x93C5B5F47356388BULL, 0x63DC359D8D231B78ULL, 0xEC16CA8AEA98AD76ULL,
+    0x5355F900C2A82DC7ULL, 0x07FB9F855A997142ULL, 0x5093417AA8A7ED5EULL, 0x7BCBC38DA25A7F3CULL,
+    0x19FC8A768CF4B6D4ULL, 0x637A7780DECFC0D9ULL, 0x8249A47AEE0E41F7ULL, 0x79AD695501E7D1E8ULL,
+    0x14ACBAF4777D5776ULL, 0xF145B6BECCDEA195ULL, 0xDABF2AC8201752FCULL, 0x24C3C94DF9C8D3F6ULL,
+    0xBB6E2924F03912EAULL, 0x0CE26C0B95C980D9ULL, 0xA49CD132BFBF7CC4ULL, 0xE99D662AF4243939ULL,
+    0x27E6AD7891165C3FULL, 0x8535F040B9744FF1ULL, 0x54B3F4FA5F40D873ULL, 0x72B12C32127FED2BULL,
+    0xEE954D3C7B411F47ULL, 0x9A85AC909A24EAA1ULL, 0x70AC4CD9F04F21F5ULL, 0xF9B89D3E99A075C2ULL,
+    0x87B3E2B2B5C907B1ULL, 0xA366E5B8C54F48B8ULL, 0xAE4A9346CC3F7CF2ULL, 0x1920C04D47267BBDULL,
+    0x87BF02C6B49E2AE9ULL, 0x092237AC237F3859ULL, 0xFF07F64EF8ED14D0ULL, 0x8DE8DCA9F03CC54EULL,
+    0x9C1633264DB49C89ULL, 0xB3F22C3D0B0B38EDULL, 0x390E5FB44D01144BULL, 0x5BFEA5B4712768E9ULL,
+    0x1E1032911FA78984ULL, 0x9A74ACB964E78CB3ULL, 0x4F80F7A035DAFB04ULL, 0x6304D09A0B3738C4ULL,
+    0x2171E64683023A08ULL, 0x5B9B63EB9CEFF80CULL, 0x506AACF489889342ULL, 0x1881AFC9A3A701D6ULL,
+    0x6503080440750644ULL, 0xDFD395339CDBF4A7ULL, 0xEF927DBCF00C20F2ULL, 0x7B32F7D1E03680ECULL,
+    0xB9FD7620E7316243ULL, 0x05A7E8A57DB91B77ULL, 0xB5889C6E15630A75ULL, 0x4A750A09CE9573F7ULL,
+    0xCF464CEC899A2F8AULL, 0xF538639CE705B824ULL, 0x3C79A0FF5580EF7FULL, 0xEDE6C87F8477609DULL,
+    0x799E81F05BC93F31ULL, 0x86536B8CF3428A8CULL, 0x97D7374C60087B73ULL, 0xA246637CFF328532ULL,
+    0x043FCAE60CC0EBA0ULL, 0x920E449535DD359EULL, 0x70EB093B15B290CCULL, 0x73A1921916591CBDULL,
+    0x56436C9FE1A1AA8DULL, 0xEFAC4B70633B8F81ULL, 0xBB215798D45DF7AFULL, 0x45F20042F24F1768ULL,
+    0x930F80F4E8EB7462ULL, 0xFF6712FFCFD75EA1ULL, 0xAE623FD67468AA70ULL, 0xDD2C5BC84BC8D8FCULL,
+    0x7EED120D54CF2DD9ULL, 0x22FE545401165F1CULL, 0xC91800E98FB99929ULL, 0x808BD68E6AC10365ULL,
+    0xDEC468145B7605F6ULL, 0x1BEDE3A3AEF53302ULL, 0x43539603D6C55602ULL, 0xAA969B5C691CCB7AULL,
+    0xA87832D392EFEE56ULL, 0x65942C7B3C7E11AEULL, 0xDED2D633CAD004F6ULL, 0x21F08570F420E565ULL,
+    0xB415938D7DA94E3CULL, 0x91B859E59ECB6350ULL, 0x10CFF333E0ED804AULL, 0x28AED140BE0BB7DDULL,
+    0xC5CC1D89724FA456ULL, 0x5648F680F11A2741ULL, 0x2D255069F0B7DAB3ULL, 0x9BC5A38EF729ABD4ULL,
+    0xEF2F054308F6A2BCULL, 0xAF2042F5CC5C2858ULL, 0x480412BAB7F5BE2AULL, 0xAEF3AF4A563DFE43ULL,
+    0x19AFE59AE451497FULL, 0x52593803DFF1E840ULL, 0xF4F076E65F2CE6F0ULL, 0x11379625747D5AF3ULL,
+    0xBCE5D2248682C115ULL, 0x9DA4243DE836994FULL, 0x066F70B33FE09017ULL, 0x4DC4DE189B671A1CULL,
+    0x51039AB7712457C3ULL, 0xC07A3F80C31FB4B4ULL, 0xB46EE9C5E64A6E7CULL, 0xB3819A42ABE61C87ULL,
+    0x21A007933A522A20ULL, 0x2DF16F761598AA4FULL, 0x763C4A1371B368FDULL, 0xF793C46702E086A0ULL,
+    0xD7288E012AEB8D31ULL, 0xDE336A2A4BC1C44BULL, 0x0BF692B38D079F23ULL, 0x2C604A7A177326B3ULL,
+    0x4850E73E03EB6064ULL, 0xCFC447F1E53C8E1BULL, 0xB05CA3F564268D99ULL, 0x9AE182C8BC9474E8ULL,
+    0xA4FC4BD4FC5558CAULL, 0xE755178D58FC4E76ULL, 0x69B97DB1A4C03DFEULL, 0xF9B5B7C4ACC67C96ULL,
+    0xFC6A82D64B8655FBULL, 0x9C684CB6C4D24417ULL, 0x8EC97D2917456ED0ULL, 0x6703DF9D2924E97EULL,
+    0xC547F57E42A7444EULL, 0x78E37644E7CAD29EULL, 0xFE9A44E9362F05FAULL, 0x08BD35CC38336615ULL,
+    0x9315E5EB3A129ACEULL, 0x94061B871E04DF75ULL, 0xDF1D9F9D784BA010ULL, 0x3BBA57B68871B59DULL,
+    0xD2B7ADEEDED1F73FULL, 0xF7A255D83BC373F8ULL, 0xD7F4F2448C0CEB81ULL, 0xD95BE88CD210FFA7ULL,
+    0x336F52F8FF4728E7ULL, 0xA74049DAC312AC71ULL, 0xA2F61BB6E437FDB5ULL, 0x4F2A5CB07F6A35B3ULL,
+    0x87D380BDA5BF7859ULL, 0x16B9F7E06C453A21ULL, 0x7BA2484C8A0FD54EULL, 0xF3A678CAD9A2E38CULL,
+    0x39B0BF7DDE437BA2ULL, 0xFCAF55C1BF8A4424ULL, 0x18FCF680573FA594ULL, 0x4C0563B89F495AC3ULL,
+    0x40E087931A00930DULL, 0x8CFFA9412EB642C1ULL, 0x68CA39053261169FULL, 0x7A1EE967D27579E2ULL,
+    0x9D1D60E5076F5B6FULL, 0x3810E399B6F65BA2ULL, 0x32095B6D4AB5F9B1ULL, 0x35CAB62109DD038AULL,
+    0xA90B24499FCFAFB1ULL, 0x77A225A07CC2C6BDULL, 0x513E5E634C70E331ULL, 0x4361C0CA3F692F12ULL,
+    0xD941ACA44B20A45BULL, 0x528F7C8602C5807BULL, 0x52AB92BEB9613989ULL, 0x9D1DFA2EFC557F73ULL,
+    0x722FF175F572C348ULL, 0x1D1260A51107FE97ULL, 0x7A249A57EC0C9BA2ULL, 0x04208FE9E8F7F2D6ULL,
+    0x5A110C6058B920A0ULL, 0x0CD9A497658A5698ULL, 0x56FD23C8F9715A4CULL, 0x284C847B9D887AAEULL,
+    0x04FEABFBBDB619CBULL, 0x742E1E651C60BA83ULL, 0x9A9632E65904AD3CULL, 0x881B82A13B51B9E2ULL,
+    0x506E6744CD974924ULL, 0xB0183DB56FFC6A79ULL, 0x0ED9B915C66ED37EULL, 0x5E11E86D5873D484ULL,
+    0xF678647E3519AC6EULL, 0x1B85D488D0F20CC5ULL, 0xDAB9FE6525D89021ULL, 0x0D151D86ADB73615ULL,
+    0xA865A54EDCC0F019ULL, 0x93C42566AEF98FFBULL, 0x99E7AFEABE000731ULL, 0x48CBFF086DDF285AULL,
+    0x7F9B6AF1EBF78BAFULL, 0x58627E1A149BBA21ULL, 0x2CD16E2ABD791E33ULL, 0xD363EFF5F0977996ULL,
+    0x0CE2A38C344A6EEDULL, 0x1A804AADB9CFA741ULL, 0x907F30421D78C5DEULL, 0x501F65EDB3034D07ULL,
+    0x37624AE5A48FA6E9ULL, 0x957BAF61700CFF4EULL, 0x3A6C27934E31188AULL, 0xD49503536ABCA345ULL,
+    0x088E049589C432E0ULL, 0xF943AEE7FEBF21B8ULL, 0x6C3B8E3E336139D3ULL, 0x364F6FFA464EE52EULL,
+    0xD60F6DCEDC314222ULL, 0x56963B0DCA418FC0ULL, 0x16F50EDF91E513AFULL, 0xEF1955914B609F93ULL,
+    0x565601C0364E3228ULL, 0xECB53939887E8175ULL, 0xBAC7A9A18531294BULL, 0xB344C470397BBA52ULL,
+    0x65D34954DAF3CEBDULL, 0xB4B81B3FA97511E2ULL, 0xB422061193D6F6A7ULL, 0x071582401C38434DULL,
+    0x7A13F18BBEDC4FF5ULL, 0xBC4097B116C524D2ULL, 0x59B97885E2F2EA28ULL, 0x99170A5DC3115544ULL,
+    0x6F423357E7C6A9F9ULL, 0x325928EE6E6F8794ULL, 0xD0E4366228B03343ULL, 0x565C31F7DE89EA27ULL,
+    0x30F5611484119414ULL, 0xD873DB391292ED4FULL, 0x7BD94E1D8E17DEBCULL, 0xC7D9F16864A76E94ULL,
+    0x947AE053EE56E63CULL, 0xC8C93882F9475F5FULL, 0x3A9BF55BA91F81CAULL, 0xD9A11FBB3D9808E4ULL,
+    0x0FD22063EDC29FCAULL, 0xB3F256D8ACA0B0B9ULL, 0xB03031A8B4516E84ULL, 0x35DD37D5871448AFULL,
+    0xE9F6082B05542E4EULL, 0xEBFAFA33D7254B59ULL, 0x9255ABB50D532280ULL, 0xB9AB4CE57F2D34F3ULL,
+    0x693501D628297551ULL, 0xC62C58F97DD949BFULL, 0xCD454F8F19C5126AULL, 0xBBE83F4ECC2BDECBULL,
+    0xDC842B7E2819E230ULL, 0xBA89142E007503B8ULL, 0xA3BC941D0A5061CBULL, 0xE9F6760E32CD8021ULL,
+    0x09C7E552BC76492FULL, 0x852F54934DA55CC9ULL, 0x8107FCCF064FCF56ULL, 0x098954D51FFF6580ULL,
+    0x23B70EDB1955C4BFULL, 0xC330DE426430F69DULL, 0x4715ED43E8A45C0AULL, 0xA8D7E4DAB780A08DULL,
+    0x0572B974F03CE0BBULL, 0xB57D2E985E1419C7ULL, 0xE8D9ECBE2CF3D73FULL, 0x2FE4B17170E59750ULL,
+    0x11317BA87905E790ULL, 0x7FBF21EC8A1F45ECULL, 0x1725CABFCB045B00ULL, 0x964E915CD5E2B207ULL,
+    0x3E2B8BCBF016D66DULL, 0xBE7444E39328A0ACULL, 0xF85B2B4FBCDE44B7ULL, 0x49353FEA39BA63B1ULL,
+    0x1DD01AAFCD53486AULL, 0x1FCA8A92FD719F85ULL, 0xFC7C95D827357AFAULL, 0x18A6A990C8B35EBDULL,
+    0xCCCB7005C6B9C28DULL, 0x3BDBB92C43B17F26ULL, 0xAA70B5B4F89695A2ULL, 0xE94C39A54A98307FULL,
+    0xB7A0B174CFF6F36EULL, 0xD4DBA84729AF48ADULL, 0x2E18BC1AD9704A68ULL, 0x2DE0966DAF2F8B1CULL,
+    0xB9C11D5B1E43A07EULL, 0x64972D68DEE33360ULL, 0x94628D38D0C20584ULL, 0xDBC0D2B6AB90A559ULL,
+    0xD2733C4335C6A72FULL, 0x7E75D99D94A70F4DULL, 0x6CED1983376FA72BULL, 0x97FCAACBF030BC24ULL,
+    0x7B77497B32503B12ULL, 0x8547EDDFB81CCB94ULL, 0x79999CDFF70902CBULL, 0xCFFE1939438E9B24ULL,
+    0x829626E3892D95D7ULL, 0x92FAE24291F2B3F1ULL, 0x63E22C147B9C3403ULL, 0xC678B6D860284A1CULL,
+    0x5873888850659AE7ULL, 0x0981DCD296A8736DULL, 0x9F65789A6509A440ULL, 0x9FF38FED72E9052FULL,
+    0xE479EE5B9930578CULL, 0xE7F28ECD2D49EECDULL, 0x56C074A581EA17FEULL, 0x5544F7D774B14AEFULL,
+    0x7B3F0195FC6F290FULL, 0x12153635B2C0CF57ULL, 0x7F5126DBBA5E0CA7ULL, 0x7A76956C3EAFB413ULL,
+    0x3D5774A11D31AB39ULL, 0x8A1B083821F40CB4ULL, 0x7B4A38E32537DF62ULL, 0x950113646D1D6E03ULL,
+    0x4DA8979A0041E8A9ULL, 0x3BC36E078F7515D7ULL, 0x5D0A12F27AD310D1ULL, 0x7F9D1A2E1EBE1327ULL,
+    0xDA3A361B1C5157B1ULL, 0xDCDD7D20903D0C25ULL, 0x36833336D068F707ULL, 0xCE68341F79893389ULL,
+    0xAB9090168DD05F34ULL, 0x43954B3252DC25E5ULL, 0xB438C2B67F98E5E9ULL, 0x10DCD78E3851A492ULL,
+    0xDBC27AB5447822BFULL, 0x9B3CDB65F82CA382ULL, 0xB67B7896167B4C84ULL, 0xBFCED1B0048EAC50ULL,
+    0xA9119B60369FFEBDULL, 0x1FFF7AC80904BF45ULL, 0xAC12FB171817EEE7ULL, 0xAF08DA9177DDA93DULL,
+    0x1B0CAB936E65C744ULL, 0xB559EB1D04E5E932ULL, 0xC37B45B3F8D6F2BAULL, 0xC3A9DC228CAAC9E9ULL,
+    0xF3B8B6675A6507FFULL, 0x9FC477DE4ED681DAULL, 0x67378D8ECCEF96CBULL, 0x6DD856D94D259236ULL,
+    0xA319CE15B0B4DB31ULL, 0x073973751F12DD5EULL, 0x8A8E849EB32781A5ULL, 0xE1925C71285279F5ULL,
+    0x74C04BF1790C0EFEULL, 0x4DDA48153C94938AULL, 0x9D266D6A1CC0542CULL, 0x7440FB816508C4FEULL,
+    0x13328503DF48229FULL, 0xD6BF7BAEE43CAC40ULL, 0x4838D65F6EF6748FULL, 0x1E152328F3318DEAULL,
+    0x8F8419A348F296BFULL, 0x72C8834A5957B511ULL, 0xD7A023A73260B45CULL, 0x94EBC8ABCFB56DAEULL,
+    0x9FC10D0F989993E0ULL, 0xDE68A2355B93CAE6ULL, 0xA44CFE79AE538BBEULL, 0x9D1D84FCCE371425ULL,
+    0x51D2B1AB2DDFB636ULL, 0x2FD7E4B9E72CD38CULL, 0x65CA5B96B7552210ULL, 0xDD69A0D8AB3B546DULL,
+    0x604D51B25FBF70E2ULL, 0x73AA8A564FB7AC9EULL, 0x1A8C1E992B941148ULL, 0xAAC40A2703D9BEA0ULL,
+    0x764DBEAE7FA4F3A6ULL, 0x1E99B96E70A9BE8BULL, 0x2C5E9DEB57EF4743ULL, 0x3A938FEE32D29981ULL,
+    0x26E6DB8FFDF5ADFEULL, 0x469356C504EC9F9DULL, 0xC8763C5B08D1908CULL, 0x3F6C6AF859D80055ULL,
+    0x7F7CC39420A3A545ULL, 0x9BFB227EBDF4C5CEULL, 0x89039D79D6FC5C5CULL, 0x8FE88B57305E2AB6ULL,
+    0xA09E8C8C35AB96DEULL, 0xFA7E393983325753ULL, 0xD6B6D0ECC617C699ULL, 0xDFEA21EA9E7557E3ULL,
+    0xB67C1FA481680AF8ULL, 0xCA1E3785A9E724E5ULL, 0x1CFC8BED0D681639ULL, 0xD18D8549D140CAEAULL,
+    0x4ED0FE7E9DC91335ULL, 0xE4DBF0634473F5D2ULL, 0x1761F93A44D5AEFEULL, 0x53898E4C3910DA55ULL,
+    0x734DE8181F6EC39AULL, 0x2680B122BAA28D97ULL, 0x298AF231C85BAFABULL, 0x7983EED3740847D5ULL,
+    0x66C1A2A1A60CD889ULL, 0x9E17E49642A3E4C1ULL, 0xEDB454E7BADC0805ULL, 0x50B704CAB602C329ULL,
+    0x4CC317FB9CDDD023ULL, 0x66B4835D9EAFEA22ULL, 0x219B97E26FFC81BDULL, 0x261E4E4C0A333A9DULL,
+    0x1FE2CCA76517DB90ULL, 0xD7504DFA8816EDBBULL, 0xB9571FA04DC089C8ULL, 0x1DDC0325259B27DEULL,
+    0xCF3F4688801EB9AAULL, 0xF4F5D05C10CAB243ULL, 0x38B6525C21A42B0EULL, 0x36F60E2BA4FA6800ULL,
+    0xEB3593803173E0CEULL, 0x9C4CD6257C5A3603ULL, 0xAF0C317D32ADAA8AULL, 0x258E5A80C7204C4BULL,
+    0x8B889D624D44885DULL, 0xF4D14597E660F855ULL, 0xD4347F66EC8941C3ULL, 0xE699ED85B0DFB40DULL,
+    0x2472F6207C2D0484ULL, 0xC2A1E7B5B459AEB5ULL, 0xAB4F6451CC1D45ECULL, 0x63767572AE3D6174ULL,
+    0xA59E0BD101731A28ULL, 0x116D0016CB948F09ULL, 0x2CF9C8CA052F6E9FULL, 0x0B090A7560A968E3ULL,
+    0xABEEDDB2DDE06FF1ULL, 0x58EFC10B06A2068DULL, 0xC6E57A78FBD986E0ULL, 0x2EAB8CA63CE802D7ULL,
+    0x14A195640116F336ULL, 0x7C0828DD624EC390ULL, 0xD74BBE77E6116AC7ULL, 0x804456AF10F5FB53ULL,
+    0xEBE9EA2ADF4321C7ULL, 0x03219A39EE587A30ULL, 0x49787FEF17AF9924ULL, 0xA1E9300CD8520548ULL,
+    0x5B45E522E4B1B4EFULL, 0xB49C3B3995091A36ULL, 0xD4490AD526F14431ULL, 0x12A8F216AF9418C2ULL,
+    0x001F837CC7350524ULL, 0x1877B51E57A764D5ULL, 0xA2853B80F17F58EEULL, 0x993E1DE72D36D310ULL,
+    0xB3598080CE64A656ULL, 0x252F59CF0D9F04BBULL, 0xD23C8E176D113600ULL, 0x1BDA0492E7E4586EULL,
+    0x21E0BD5026C619BFULL, 0x3B097ADAF088F94EULL, 0x8D14DEDB30BE846EULL, 0xF95CFFA23AF5F6F4ULL,
+    0x3871700761B3F743ULL, 0xCA672B91E9E4FA16ULL, 0x64C8E531BFF53B55ULL, 0x241260ED4AD1E87DULL,
+    0x106C09B972D2E822ULL, 0x7FBA195410E5CA30ULL, 0x7884D9BC6CB569D8ULL, 0x0647DFEDCD894A29ULL,
+    0x63573FF03E224774ULL, 0x4FC8E9560F91B123ULL, 0x1DB956E450275779ULL, 0xB8D91274B9E9D4FBULL,
+    0xA2EBEE47E2FBFCE1ULL, 0xD9F1F30CCD97FB09ULL, 0xEFED53D75FD64E6BULL, 0x2E6D02C36017F67FULL,
+    0xA9AA4D20DB084E9BULL, 0xB64BE8D8B25396C1ULL, 0x70CB6AF7C2D5BCF0ULL, 0x98F076A4F7A2322EULL,
+    0xBF84470805E69B5FULL, 0x94C3251F06F90CF3ULL, 0x3E003E616A6591E9ULL, 0xB925A6CD0421AFF3ULL,
+    0x61BDD1307C66E300ULL, 0xBF8D5108E27E0D48ULL, 0x240AB57A8B888B20ULL, 0xFC87614BAF287E07ULL,
+    0xEF02CDD06FFDB432ULL, 0xA1082C0466DF6C0AULL, 0x8215E577001332C8ULL, 0xD39BB9C3A48DB6CFULL,
+    0x2738259634305C14ULL, 0x61CF4F94C97DF93DULL, 0x1B6BACA2AE4E125BULL, 0x758F450C88572E0BULL,
+    0x959F587D507A8359ULL, 0xB063E962E045F54DULL, 0x60E8ED72C0DFF5D1ULL, 0x7B64978555326F9FULL,
+    0xFD080D236DA814BAULL, 0x8C90FD9B083F4558ULL, 0x106F72FE81E2C590ULL, 0x7976033A39F7D952ULL,
+    0xA4EC0132764CA04BULL, 0x733EA705FAE4FA77ULL, 0xB4D8F77BC3E56167ULL, 0x9E21F4F903B33FD9ULL,
+    0x9D765E419FB69F6DULL, 0xD30C088BA61EA5EFULL, 0x5D94337FBFAF7F5BULL, 0x1A4E4822EB4D7A59ULL,
+    0x6FFE73E81B637FB3ULL, 0xDDF957BC36D8B9CAULL, 0x64D0E29EEA8838B3ULL, 0x08DD9BDFD96B9F63ULL,
+    0x087E79E5A57D1D13ULL, 0xE328E230E3E2B3FBULL, 0x1C2559E30F0946BEULL, 0x720BF5F26F4D2EAAULL,
+    0xB0774D261CC609DBULL, 0x443F64EC5A371195ULL, 0x4112CF68649A260EULL, 0xD813F2FAB7F5C5CAULL,
+    0x660D3257380841EEULL, 0x59AC2C7873F910A3ULL, 0xE846963877671A17ULL, 0x93B633ABFA3469F8ULL,
+    0xC0C0F5A60EF4CDCFULL, 0xCAF21ECD4377B28CULL, 0x57277707199B8175ULL, 0x506C11B9D90E8B1DULL,
+    0xD83CC2687A19255FULL, 0x4A29C6465A314CD1ULL, 0xED2DF21216235097ULL, 0xB5635C95FF7296E2ULL,
+    0x22AF003AB672E811ULL, 0x52E762596BF68235ULL, 0x9AEBA33AC6ECC6B0ULL, 0x944F6DE09134DFB6ULL,
+    0x6C47BEC883A7DE39ULL, 0x6AD047C430A12104ULL, 0xA5B1CFDBA0AB4067ULL, 0x7C45D833AFF07862ULL,
+    0x5092EF950A16DA0BULL, 0x9338E69C052B8E7BULL, 0x455A4B4CFE30E3F5ULL, 0x6B02E63195AD0CF8ULL,
+    0x6B17B224BAD6BF27ULL, 0xD1E0CCD25BB9C169ULL, 0xDE0C89A556B9AE70ULL, 0x50065E535A213CF6ULL,
+    0x9C1169FA2777B874ULL, 0x78EDEFD694AF1EEDULL, 0x6DC93D9526A50E68ULL, 0xEE97F453F06791EDULL,
+    0x32AB0EDB696703D3ULL, 0x3A6853C7E70757A7ULL, 0x31865CED6120F37DULL, 0x67FEF95D92607890ULL,
+    0x1F2B1D1F15F6DC9CULL, 0xB69E38A8965C6B65ULL, 0xAA9119FF184CCCF4ULL, 0xF43C732873F24C13ULL,
+    0xFB4A3D794A9A80D2ULL, 0x3550C2321FD6109CULL, 0x371F77E76BB8417EULL, 0x6BFA9AAE5EC05779ULL,
+    0xCD04F3FF001A4778ULL, 0xE3273522064480CAULL, 0x9F91508BFFCFC14AULL, 0x049A7F41061A9E60ULL,
+    0xFCB6BE43A9F2FE9BULL, 0x08DE8A1C7797DA9BULL, 0x8F9887E6078735A1ULL, 0xB5B4071DBFC73A66ULL,
+    0x230E343DFBA08D33ULL, 0x43ED7F5A0FAE657DULL, 0x3A88A0FBBCB05C63ULL, 0x21874B8B4D2DBC4FULL,
+    0x1BDEA12E35F6A8C9ULL, 0x53C065C6C8E63528ULL, 0xE34A1D250E7A8D6BULL, 0xD6B04D3B7651DD7EULL,
+    0x5E90277E7CB39E2DULL, 0x2C046F22062DC67DULL, 0xB10BB459132D0A26ULL, 0x3FA9DDFB67E2F199ULL,
+    0x0E09B88E1914F7AFULL, 0x10E8B35AF3EEAB37ULL, 0x9EEDECA8E272B933ULL, 0xD4C718BC4AE8AE5FULL,
+    0x81536D601170FC20ULL, 0x91B534F885818A06ULL, 0xEC8177F83F900978ULL, 0x190E714FADA5156EULL,
+    0xB592BF39B0364963ULL, 0x89C350C893AE7DC1ULL, 0xAC042E70F8B383F2ULL, 0xB49B52E587A1EE60ULL,
+    0xFB152FE3FF26DA89ULL, 0x3E666E6F69AE2C15ULL, 0x3B544EBE544C19F9ULL, 0xE805A1E290CF2456ULL,
+    0x24B33C9D7ED25117ULL, 0xE74733427B72F0C1ULL, 0x0A804D18B7097475ULL, 0x57E3306D881EDB4FULL,
+    0x4AE7D6A36EB5DBCBULL, 0x2D8D5432157064C8ULL, 0xD1E649DE1E7F268BULL, 0x8A328A1CEDFE552CULL,
+    0x07A3AEC79624C7DAULL, 0x84547DDC3E203C94ULL, 0x990A98FD5071D263ULL, 0x1A4FF12616EEFC89ULL,
+    0xF6F7FD1431714200ULL, 0x30C05B1BA332F41CULL, 0x8D2636B81555A786ULL, 0x46C9FEB55D120902ULL,
+    0xCCEC0A73B49C9921ULL, 0x4E9D2827355FC492ULL, 0x19EBB029435DCB0FULL, 0x4659D2B743848A2CULL,
+    0x963EF2C96B33BE31ULL, 0x74F85198B05A2E7DULL, 0x5A0F544DD2B1FB18ULL, 0x03727073C2E134B1ULL,
+    0xC7F6AA2DE59AEA61ULL, 0x352787BAA0D7C22FULL, 0x9853EAB63B5E0B35ULL, 0xABBDCDD7ED5C0860ULL,
+    0xCF05DAF5AC8D77B0ULL, 0x49CAD48CEBF4A71EULL, 0x7A4C10EC2158C4A6ULL, 0xD9E92AA246BF719EULL,
+    0x13AE978D09FE5557ULL, 0x730499AF921549FFULL, 0x4E4B705B92903BA4ULL, 0xFF577222C14F0A3AULL,
+    0x55B6344CF97AAFAEULL, 0xB862225B055B6960ULL, 0xCAC09AFBDDD2CDB4ULL, 0xDAF8E9829FE96B5FULL,
+    0xB5FDFC5D3132C498ULL, 0x310CB380DB6F7503ULL, 0xE87FBB46217A360EULL, 0x2102AE466EBB1148ULL,
+    0xF8549E1A3AA5E00DULL, 0x07A69AFDCC42261AULL, 0xC4C118BFE78FEAAEULL, 0xF9F4892ED96BD438ULL,
+    0x1AF3DBE25D8F45DAULL, 0xF5B4B0B0D2DEEEB4ULL, 0x962ACEEFA82E1C84ULL, 0x046E3ECAAF453CE9ULL,
+    0xF05D129681949A4CULL, 0x964781CE734B3C84ULL, 0x9C2ED44081CE5FBDULL, 0x522E23F3925E319EULL,
+    0x177E00F9FC32F791ULL, 0x2BC60A63A6F3B3F2ULL, 0x222BBFAE61725606ULL, 0x486289DDCC3D6780ULL,
+    0x7DC7785B8EFDFC80ULL, 0x8AF38731C02BA980ULL, 0x1FAB64EA29A2DDF7ULL, 0xE4D9429322CD065AULL,
+    0x9DA058C67844F20CULL, 0x24C0E332B70019B0ULL, 0x233003B5A6CFE6ADULL, 0xD586BD01C5C217F6ULL,
+    0x5E5637885F29BC2BULL, 0x7EBA726D8C94094BULL, 0x0A56A5F0BFE39272ULL, 0xD79476A84EE20D06ULL,
+    0x9E4C1269BAA4BF37ULL, 0x17EFEE45B0DEE640ULL, 0x1D95B0A5FCF90BC6ULL, 0x93CBE0B699C2585DULL,
+    0x65FA4F227A2B6D79ULL, 0xD5F9E858292504D5ULL, 0xC2B5A03F71471A6FULL, 0x59300222B4561E00ULL,
+    0xCE2F8642CA0712DCULL, 0x7CA9723FBB2E8988ULL, 0x2785338347F2BA08ULL, 0xC61BB3A141E50E8CULL,
+    0x150F361DAB9DEC26ULL, 0x9F6A419D382595F4ULL, 0x64A53DC924FE7AC9ULL, 0x142DE49FFF7A7C3DULL,
+    0x0C335248857FA9E7ULL, 0x0A9C32D5EAE45305ULL, 0xE6C42178C4BBB92EULL, 0x71F1CE2490D20B07ULL,
+    0xF1BCC3D275AFE51AULL, 0xE728E8C83C334074ULL, 0x96FBF83A12884624ULL, 0x81A1549FD6573DA5ULL,
+    0x5FA7867CAF35E149ULL, 0x56986E2EF3ED091BULL, 0x917F1DD5F8886C61ULL, 0xD20D8C88C8FFE65FULL,
+    0x31D71DCE64B2C310ULL, 0xF165B587DF898190ULL, 0xA57E6339DD2CF3A0ULL, 0x1EF6E6DBB1961EC9ULL,
+    0x70CC73D90BC26E24ULL, 0xE21A6B35DF0C3AD7ULL, 0x003A93D8B2806962ULL, 0x1C99DED33CB890A1ULL,
+    0xCF3145DE0ADD4289ULL, 0xD0E4427A5514FB72ULL, 0x77C621CC9FB3A483ULL, 0x67A34DAC4356550BULL,
+    0xF8D626AAAF278509ULL
+};
+
+uint64_t BookKey(const Board& board) {
+    uint64_t key = 0;
+    for (int color = 0; color < 2; color++) {
+        for (int piece = PAWN; piece <= KING; piece++) {
+            int kind = 2 * (piece - 1) + (color == WHITE); // black pawn, white pawn, black knight, ...
+            for (uint64_t bb = board.bitboard(color, (Piece)piece); bb; bb &= bb - 1)
+                key ^= bookRandom[64 * kind + __builtin_ctzll(bb)];
+        }
+    }
+    constexpr uint8_t castleBits[4] = {1 << 3, 1 << 2, 1 << 1, 1 << 0}; // K Q k q
+    for (int i = 0; i < 4; i++)
+        if (board.castlingRights & castleBits[i]) key ^= bookRandom[768 + i];
+    // The en passant file only counts when a pawn of the side to move can actually capture
+    if (board.hasEnPassant()) {
+        int target = board.getEnPassantTarget();
+        int us = board.whiteToMove ? WHITE : BLACK;
+        if (pawnAttacks[1 - us][target] & board.bitboard(us, PAWN)) key ^= bookRandom[772 + (target & 7)];
+    }
+    if (board.whiteToMove) key ^= bookRandom[780];
+    return key;
+}
+
+// Polyglot move: to file/rank, from file/rank, promotion piece. Castling is written as the king taking its rook
+uint16_t ToBookMove(Move move) {
+    int to = move.to();
+    if (move.isCastling()) to = to > move.from() ? to + 1 : to - 2;
+    int promotion = move.isPromotion() ? move.promotion() - PAWN : 0;
+    return (uint16_t)(to | move.from() << 6 | promotion << 12);
+}
+
+Move FromBookMove(Board& board, uint16_t bookMove) {
+    int to = bookMove & 63, from = (bookMove >> 6) & 63, promotion = (bookMove >> 12) & 7;
+    if (board.pieceOn(from) == KING && board.pieceOn(to) == ROOK && (bitMasks[to] & (board.whiteToMove ? board.occupancy[WHITE] : board.occupancy[BLACK])))
+        to = to > from ? from + 2 : from - 2;
+    MoveList moves;
+    GenerateLegalMoves(board, moves);
+    for (Move move : moves) {
+        if (move.from() == from && move.to() == to && (move.isPromotion() ? move.promotion() - PAWN : 0) == promotion)
+            return move;
+    }
+    return NO_MOVE;
+}
+
+constexpr int BOOK_ENTRY_SIZE = 16;
+
+// A book file mapped read-only into memory: opening it costs no reads, probes binary search the mapping
+class OpeningBook {
+public:
+    ~OpeningBook() { Close(); }
+
+    bool Open(const string& path) {
+        Close();
+#ifdef __linux__
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size >= BOOK_ENTRY_SIZE) {
+            void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                data = (const uint8_t*)mapped;
+                size = info.st_size;
+            }
+        }
+        close(fd);
+#endif
+        return data != nullptr;
+    }
+
+    void Close() {
+#ifdef __linux__
+        if (data) munmap((void*)data, size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+
+    bool loaded() const { return data != nullptr; }
+
+    // A book move for the position picked at random in proportion to the entry weights, NO_MOVE when the
+    // position is not in the book or lies deeper than maxPly plies into the game
+    Move Probe(Board& board) const {
+        if (!data || GamePly(board) >= maxPly) return NO_MOVE;
+        uint64_t key = BookKey(board);
+        size_t count = size / BOOK_ENTRY_SIZE;
+
+        size_t low = 0, high = count;
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            if (ReadBigEndian(data + mid * BOOK_ENTRY_SIZE, 8) < key) low = mid + 1;
+            else high = mid;
+        }
+
+        uint16_t moves[64];
+        uint32_t weights[64];
+        int found = 0;
+        uint32_t total = 0;
+        for (size_t i = low; i < count && found < 64; i++) {
+            const uint8_t* entry = data + i * BOOK_ENTRY_SIZE;
+            if (ReadBigEndian(entry, 8) != key) break;
+            moves[found] = (uint16_t)ReadBigEndian(entry + 8, 2);
+            weights[found] = (uint32_t)ReadBigEndian(entry + 10, 2);
+            total += weights[found++];
+        }
+        if (total == 0) return NO_MOVE;
+
+        static thread_local uint64_t state = chrono::steady_clock::now().time_since_epoch().count() | 1;
+        state ^= state >> 12; state ^= state << 25; state ^= state >> 27;
+        uint32_t pick = (uint32_t)((state * 2685821657736338717ULL) >> 32) % total;
+        for (int i = 0; i < found; i++) {
+            if (pick < weights[i]) return FromBookMove(board, moves[i]);
+            pick -= weights[i];
+        }
+        return NO_MOVE;
+    }
+
+    int maxPly = 20; // "BookDepth" option
+
+private:
+    static int GamePly(const Board& board) {
+        return 2 * (board.fullmoveNumber - 1) + !board.whiteToMove;
+    }
+
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
+OpeningBook openingBook;
+
+// Standard algebraic notation in the given position, NO_MOVE if it names no legal move or more than one
+Move ParseSan(Board& board, string_view san) {
+    while (!san.empty() && strchr("+#!?", san.back())) san.remove_suffix(1);
+    if (san.size() < 2) return NO_MOVE;
+
+    MoveList moves;
+    GenerateLegalMoves(board, moves);
+    if (san == "O-O" || san == "0-0" || san == "O-O-O" || san == "0-0-0") {
+        bool kingside = san.size() == 3;
+        for (Move move : moves)
+            if (move.isCastling() && (move.to() > move.from()) == kingside) return move;
+        return NO_MOVE;
+    }
+
+    Piece promotion = EMPTY;
+    size_t equals = san.find('=');
+    if (equals != string_view::npos) {
+        if (equals + 1 >= san.size()) return NO_MOVE;
+        promotion = charToPiece(san[equals + 1]);
+        san = san.substr(0, equals);
+    } else if (strchr("NBRQ", san.back())) {
+        promotion = charToPiece(san.back());
+        san.remove_suffix(1);
+    }
+    if (san.size() < 2) return NO_MOVE;
+
+    Piece piece = PAWN;
+    if (strchr("NBRQK", san[0])) {
+        piece = charToPiece(san[0]);
+        san.remove_prefix(1);
+    }
+    int file = san[san.size() - 2] - 'a', rank = san[san.size() - 1] - '1';
+    if (file < 0 || file > 7 || rank < 0 || rank > 7) return NO_MOVE;
+    int to = rank * 8 + file;
+
+    int fromFile = -1, fromRank = -1; // disambiguation
+    for (char c : san.substr(0, san.size() - 2)) {
+        if (c >= 'a' && c <= 'h') fromFile = c - 'a';
+        else if (c >= '1' && c <= '8') fromRank = c - '1';
+    }
+
+    Move found = NO_MOVE;
+    for (Move move : moves) {
+        if (move.to() != to || board.pieceOn(move.from()) != piece || move.isCastling()) continue;
+        if ((move.isPromotion() ? move.promotion() : EMPTY) != promotion) continue;
+        if ((fromFile >= 0 && (move.from() & 7) != fromFile) || (fromRank >= 0 && (move.from() >> 3) != fromRank)) continue;
+        if (found != NO_MOVE) return NO_MOVE;
+        found = move;
+    }
+    return found;
+}
+
+// Standard algebraic notation of a legal move, with the check or mate mark
+string MoveToSan(Board& board, Move move) {
+    constexpr const char* letters = " PNBRQK";
+    Piece piece = board.pieceOn(move.from());
+    bool capture = board.pieceOn(move.to()) != EMPTY || move.isEnPassant();
+    string san;
+    if (move.isCastling()) {
+        san = move.to() > move.from() ? "O-O" : "O-O-O";
+    } else if (piece == PAWN) {
+        if (capture) san = string(1, indexToSquare(move.from())[0]) + "x";
+        san += indexToSquare(move.to());
+        if (move.isPromotion()) san += string("=") + letters[move.promotion()];
+    } else {
+        san = letters[piece];
+        // Another piece of the same kind reaching the square: name the file, else the rank, else both
+        MoveList moves;
+        GenerateLegalMoves(board, moves);
+        bool ambiguous = false, sameFile = false, sameRank = false;
+        for (Move other : moves) {
+            if (other == move || other.to() != move.to() || board.pieceOn(other.from()) != piece) continue;
+            ambiguous = true;
+            sameFile |= (other.from() & 7) == (move.from() & 7);
+            sameRank |= (other.from() >> 3) == (move.from() >> 3);
+        }
+        string from = indexToSquare(move.from());
+        if (ambiguous) san += !sameFile ? from.substr(0, 1) : !sameRank ? from.substr(1, 1) : from;
+        if (capture) san += "x";
+        san += indexToSquare(move.to());
+    }
+
+    board.make_move(move);
+    if (board.is_king_in_check(board.whiteToMove)) {
+        MoveList replies;
+        GenerateLegalMoves(board, replies);
+        san += replies.empty() ? "#" : "+";
+    }
+    board.unmake_move();
+    return san;
+}
+
+struct BookRecord {
+    uint64_t key;
+    uint16_t move;
+    uint32_t weight;
+};
+
+// Replays one PGN game and records every position up to maxPly with the move played from it, weighted
+// 2 for a win, 1 for a draw and 0 for a loss of the side that played it. Returns false if a move fails to parse
+bool ReplayPgnGame(Board& board, const string& game, int maxPly, vector<BookRecord>& records) {
+    string fen = START_FEN, result;
+    string movetext;
+    istringstream lines(game);
+    string line;
+    while (getline(lines, line)) {
+        if (!line.empty() && line[0] == '[') {
+            size_t open = line.find('"'), close = line.rfind('"');
+            if (open == string::npos || close <= open) continue;
+            string value = line.substr(open + 1, close - open - 1);
+            if (line.rfind("[FEN ", 0) == 0) fen = value;
+            else if (line.rfind("[Result ", 0) == 0) result = value;
+        } else {
+            movetext += line;
+            movetext += '\n';
+        }
+    }
+    int whiteScore = result == "1-0" ? 2 : result == "0-1" ? 0 : result == "1/2-1/2" ? 1 : -1;
+    if (whiteScore < 0) return true; // unfinished games say nothing about their moves
+
+    board.setBB(fen);
+    int depth = 0; // comment braces and variation parentheses
+    size_t pos = 0;
+    for (int ply = 0; ply < maxPly && pos < movetext.size(); ) {
+        char c = movetext[pos];
+        if (c == '{' || c == '(') { depth++; pos++; continue; }
+        if (c == '}' || c == ')') { depth--; pos++; continue; }
+        if (depth > 0 || isspace((unsigned char)c)) { pos++; continue; }
+        if (c == ';') { pos = movetext.find('\n', pos); continue; }
+
+        size_t end = movetext.find_first_of(" \n{(;", pos);
+        if (end == string::npos) end = movetext.size();
+        string_view token = string_view(movetext).substr(pos, end - pos);
+        pos = end;
+
+        size_t dot = token.find_last_of('.');
+        if (dot != string_view::npos) token.remove_prefix(dot + 1); // "12." and "12..." move numbers
+        if (token.empty() || token[0] == '$' || token == "*" || token == "1-0" || token == "0-1" || token == "1/2-1/2") continue;
+
+        Move move = ParseSan(board, token);
+        if (move == NO_MOVE) return false;
+        int score = board.whiteToMove ? whiteScore : 2 - whiteScore;
+        if (score > 0) records.push_back({BookKey(board), ToBookMove(move), (uint32_t)score});
+        board.make_move(move);
+        ply++;
+    }
+    return true;
+}
+
+// buildbook <pgn> <book.bin> [depth N] [threads T]
+// One thread reads the PGN and hands batches of games to the workers, which replay them in parallel.
+// Equal (position, move) pairs are merged, their weights summed and scaled to fit 16 bits
+void BuildBook(const string& pgnPath, const string& bookPath, int maxPly, int threadCount) {
+    auto start = chrono::steady_clock::now();
+    ifstream pgn(pgnPath);
+    if (!pgn) {
+        cerr << "[Warning] Cannot open " << pgnPath << endl;
+        return;
+    }
+
+    constexpr size_t BATCH_SIZE = 256;
+    mutex queueMutex;
+    condition_variable changed;
+    deque<vector<string>> batches;
+    bool finished = false;
+    atomic<uint64_t> games{0}, failed{0};
+    vector<vector<BookRecord>> records(threadCount);
+
+    auto worker = [&](int id) {
+        Board board;
+        while (true) {
+            vector<string> batch;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                changed.wait(lock, [&] { return finished || !batches.empty(); });
+                if (batches.empty()) return;
+                batch = std::move(batches.front());
+                batches.pop_front();
+            }
+            changed.notify_all();
+            for (const string& game : batch) {
+                if (!ReplayPgnGame(board, game, maxPly, records[id])) failed++;
+                games++;
+            }
+        }
+    };
+    vector<thread> workers;
+    for (int i = 0; i < threadCount; i++) workers.emplace_back(worker, i);
+
+    // Reads the file once, a new game starts at the first tag line after movetext
+    auto push = [&](vector<string>& batch) {
+        unique_lock<mutex> lock(queueMutex);
+        changed.wait(lock, [&] { return batches.size() < (size_t)threadCount * 4; });
+        batches.push_back(std::move(batch));
+        batch.clear();
+        changed.notify_all();
+    };
+    vector<string> batch;
+    string game, line;
+    bool inMovetext = false;
+    while (getline(pgn, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        bool tag = !line.empty() && line[0] == '[';
+        if (tag && inMovetext) {
+            batch.push_back(std::move(game));
+            game.clear();
+            inMovetext = false;
+            if (batch.size() == BATCH_SIZE) push(batch);
+        }
+        if (!tag && !line.empty()) inMovetext = true;
+        game += line;
+        game += '\n';
+    }
+    if (inMovetext) batch.push_back(std::move(game));
+    if (!batch.empty()) push(batch);
+    {
+        lock_guard<mutex> lock(queueMutex);
+        finished = true;
+    }
+    changed.notify_all();
+    for (thread& t : workers) t.join();
+
+    vector<BookRecord> all;
+    for (auto& part : records) all.insert(all.end(), part.begin(), part.end());
+    sort(all.begin(), all.end(), [](const BookRecord& a, const BookRecord& b) {
+        return a.key != b.key ? a.key < b.key : a.move < b.move;
+    });
+    vector<BookRecord> merged;
+    uint32_t maxWeight = 0;
+    for (const BookRecord& record : all) {
+        if (!merged.empty() && merged.back().key == record.key && merged.back().move == record.move)
+            merged.back().weight += record.weight;
+        else
+            merged.push_back(record);
+        maxWeight = max(maxWeight, merged.back().weight);
+    }
+    // Within a position the heavier moves come first, as Polyglot tools expect
+    stable_sort(merged.begin(), merged.end(), [](const BookRecord& a, const BookRecord& b) {
+        return a.key != b.key ? a.key < b.key : a.weight > b.weight;
+    });
+
+    ofstream out(bookPath, ios::binary);
+    if (!out) {
+        cerr << "[Warning] Cannot write " << bookPath << endl;
+        return;
+    }
+    for (const BookRecord& record : merged) {
+        uint8_t entry[BOOK_ENTRY_SIZE] = {};
+        uint64_t weight = maxWeight > 65535 ? max<uint64_t>(1, (uint64_t)record.weight * 65535 / maxWeight) : record.weight;
+        WriteBigEndian(entry, record.key, 8);
+        WriteBigEndian(entry + 8, record.move, 2);
+        WriteBigEndian(entry + 10, weight, 2);
+        out.write((const char*)entry, BOOK_ENTRY_SIZE);
+    }
+
+    int64_t ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    cout << "Games: " << games << " (" << failed << " with unreadable moves), entries: " << merged.size()
+         << ", time: " << ms << " ms" << endl << flush;
+}
+
+// Runs body(begin, end, thread) over chunks of [0, count) handed out to threadCount threads
+template<typename Body>
+void ParallelFor(size_t count, int threadCount, Body body) {
+    constexpr size_t CHUNK = 4096;
+    atomic<size_t> next{0};
+    auto worker = [&](int id) {
+        for (size_t begin = next.fetch_add(CHUNK); begin < count; begin = next.fetch_add(CHUNK))
+            body(begin, min(count, begin + CHUNK), id);
+    };
+    vector<thread> helpers;
+    for (int i = 1; i < threadCount; i++) helpers.emplace_back(worker, i);
+    worker(0);
+    for (thread& t : helpers) t.join();
+}
+
+// Squares a piece can have come from with a move that was not a capture or promotion. White moves up the board
+uint64_t UnmoveTargets(Piece piece, int color, int sq, uint64_t occupied) {
+    switch (piece) {
+        case PAWN: {
+            int step = color == WHITE ? -8 : 8;
+            int from = sq + step;
+            if (from < 8 || from >= 56 || (occupied & bitMasks[from])) return 0;
+            uint64_t targets = bitMasks[from];
+            if ((sq >> 3) == (color == WHITE ? 3 : 4) && !(occupied & bitMasks[from + step])) targets |= bitMasks[from + step];
+            return targets;
+        }
+        case KNIGHT: return knightAttacks[sq] & ~occupied;
+        case BISHOP: return BishopAttacks(sq, occupied) & ~occupied;
+        case ROOK: return RookAttacks(sq, occupied) & ~occupied;
+        case QUEEN: return QueenAttacks(sq, occupied) & ~occupied;
+        default: return kingAttacks[sq] & ~occupied;
+    }
+}
+
+// Retrograde analysis of one table, with the stronger side as White. Every position is set up once: illegal
+// ones are marked, mates and stalemates resolved, and captures and promotions, which leave the table, are looked
+// up in the smaller tables. The other legal moves are counted. Results then spread backwards through un-moves:
+// a position that can move into a lost one is won, one whose counted moves all run out into won positions is
+// lost. Whatever is still open when nothing spreads any more is a draw
+unique_ptr<Bitbase> GenerateBitbase(uint64_t key, const Bitbases& smaller, int threadCount) {
+    constexpr uint8_t OPEN = 4;
+    auto table = make_unique<Bitbase>(key);
+    int n = table->pieceCount;
+    size_t count = table->positions();
+    vector<atomic<uint8_t>> status(count), pending(count);
+    vector<vector<uint32_t>> resolved(threadCount);
+
+    ParallelFor(count, threadCount, [&](size_t begin, size_t end, int id) {
+        Board board;
+        int squares[BITBASE_MAX_PIECES];
+        for (size_t index = begin; index < end; index++) {
+            int stm = table->Decode(index, squares);
+            uint64_t occupied = 0;
+            bool valid = true;
+            for (int i = 0; i < n; i++) {
+                if ((occupied & bitMasks[squares[i]]) || (table->pieces[i] == PAWN && (squares[i] < 8 || squares[i] >= 56)))
+                    valid = false;
+                occupied |= bitMasks[squares[i]];
+            }
+            if (valid) {
+                board.setPieces(table->sides, table->pieces, squares, n, stm == 0);
+                valid = !board.is_king_in_check(!board.whiteToMove);
+            }
+            if (!valid) {
+                status[index].store(BB_INVALID, memory_order_relaxed);
+                continue;
+            }
+
+            MoveList moves;
+            GenerateLegalMoves(board, moves);
+            uint8_t result = OPEN;
+            int open = 0;
+            for (Move move : moves) {
+                if (board.pieceOn(move.to()) == EMPTY && !move.isPromotion()) {
+                    open++;
+                    continue;
+                }
+                board.make_move(move);
+                int value;
+                if (!smaller.Probe(board, value)) value = BB_DRAW;
+                board.unmake_move();
+                if (value == BB_LOSS) {
+                    result = BB_WIN;
+                    break;
+                }
+                if (value == BB_DRAW) open++; // keeps the position from ever counting as lost
+            }
+            if (result == OPEN && open == 0)
+                result = moves.empty() && !board.is_king_in_check(board.whiteToMove) ? BB_DRAW : BB_LOSS;
+            status[index].store(result, memory_order_relaxed);
+            pending[index].store((uint8_t)open, memory_order_relaxed);
+            if (result == BB_WIN || result == BB_LOSS) resolved[id].push_back((uint32_t)index);
+        }
+    });
+
+    vector<uint32_t> frontier;
+    auto collect = [&] {
+        frontier.clear();
+        for (auto& part : resolved) {
+            frontier.insert(frontier.end(), part.begin(), part.end());
+            part.clear();
+        }
+    };
+    for (collect(); !frontier.empty(); collect()) {
+        ParallelFor(frontier.size(), threadCount, [&](size_t begin, size_t end, int id) {
+            int squares[BITBASE_MAX_PIECES];
+            for (size_t f = begin; f < end; f++) {
+                size_t index = frontier[f];
+                int stm = table->Decode(index, squares);
+                bool lost = status[index].load(memory_order_relaxed) == BB_LOSS;
+                uint64_t occupied = 0;
+                for (int i = 0; i < n; i++) occupied |= bitMasks[squares[i]];
+
+                // The side that just moved takes a move back and is to move in the predecessor
+                for (int i = 0; i < n; i++) {
+                    if (table->sides[i] == stm) continue;
+                    int from = squares[i];
+                    for (uint64_t targets = UnmoveTargets(table->pieces[i], table->sides[i], from, occupied); targets; targets &= targets - 1) {
+                        squares[i] = __builtin_ctzll(targets);
+                        size_t previous = table->Index(stm ^ 1, squares);
+                        uint8_t expected = OPEN;
+                        if (status[previous].load(memory_order_relaxed) != OPEN) continue;
+                        if (lost) {
+                            if (status[previous].compare_exchange_strong(expected, BB_WIN, memory_order_relaxed))
+                                resolved[id].push_back((uint32_t)previous);
+                        } else if (pending[previous].fetch_sub(1, memory_order_relaxed) == 1) {
+                            if (status[previous].compare_exchange_strong(expected, BB_LOSS, memory_order_relaxed))
+                                resolved[id].push_back((uint32_t)previous);
+                        }
+                    }
+                    squares[i] = from;
+                }
+            }
+        });
+    }
+
+    table->owned.assign(count / 4, 0);
+    for (size_t index = 0; index < count; index++) {
+        uint8_t value = status[index].load(memory_order_relaxed);
+        table->owned[index >> 2] |= (value == OPEN ? (uint8_t)BB_DRAW : value) << (2 * (index & 3));
+    }
+    table->data = table->owned.data();
+    return table;
+}
+
+// The tables a capture or promotion in the given material set leads to
+vector<uint64_t> BitbaseChildren(uint64_t key) {
+    vector<uint64_t> children;
+    for (int side = 0; side < 2; side++) {
+        for (int kind = 0; kind < 5; kind++) {
+            uint32_t signature[2] = {(uint32_t)(key >> 32), (uint32_t)key};
+            int shift = 4 * (4 - kind);
+            if (!((signature[side] >> shift) & 15)) continue;
+            signature[side] -= 1u << shift;
+            if (signature[0] | signature[1]) children.push_back(CanonicalMaterial(signature[0], signature[1]));
+            if (bitbaseOrder[kind] != PAWN) continue;
+            for (int promotion = 0; promotion < 4; promotion++) {
+                uint32_t promoted[2] = {signature[0], signature[1]};
+                promoted[side] += 1u << (4 * (4 - promotion));
+                children.push_back(CanonicalMaterial(promoted[0], promoted[1]));
+            }
         }
     }
+    return children;
 }
 
-void GenerateSlidingMoves(uint64_t pieces, const int directions[][2], int dirCount, uint64_t own, uint64_t enemy, vector<Move>& moves) {
-    while (pieces) {
-        int sq = __builtin_ctzll(pieces);
-        pieces &= pieces - 1;
+// genbitbase: builds the requested tables and every smaller one they can reach, writes each to
+// <dir>/<material>.nbb and then loads the directory for the search
+void GenerateBitbases(const string& dir, vector<uint64_t> materials, int threadCount) {
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < materials.size(); i++)
+        for (uint64_t child : BitbaseChildren(materials[i]))
+            if (find(materials.begin(), materials.end(), child) == materials.end()) materials.push_back(child);
+    vector<uint64_t> ordered;
+    for (uint64_t key : BitbaseMaterials(BITBASE_MAX_PIECES))
+        if (find(materials.begin(), materials.end(), key) != materials.end()) ordered.push_back(key);
 
-        int rank = sq >> 3;
-        int file = sq & 7;
+#ifdef __linux__
+    mkdir(dir.c_str(), 0755);
+#endif
+    Bitbases built;
+    for (uint64_t key : ordered) {
+        auto tableStart = chrono::steady_clock::now();
+        unique_ptr<Bitbase> table = GenerateBitbase(key, built, threadCount);
+        uint64_t counts[4] = {};
+        for (size_t index = 0; index < table->positions(); index++) counts[table->Get(index)]++;
 
-        for (int d = 0; d < dirCount; d++) {
-            int r = rank + directions[d][0];
-            int f = file + directions[d][1];
-            while (r >= 0 && r < 8 && f >= 0 && f < 8) {
-                int target = r * 8 + f;
-                uint64_t targetBB = bitMasks[target];
-                if (own & targetBB) break;
-                moves.push_back(Move(sq, target));
-                if (enemy & targetBB) break;
-                r += directions[d][0];
-                f += directions[d][1];
-            }
+        string path = dir + "/" + MaterialName(key) + ".nbb";
+        ofstream out(path, ios::binary);
+        uint8_t header[BITBASE_HEADER_SIZE] = {'N', 'B', 'B', '1'};
+        WriteBigEndian(header + 4, key, 8);
+        header[12] = (uint8_t)table->pieceCount;
+        out.write((const char*)header, BITBASE_HEADER_SIZE);
+        out.write((const char*)table->owned.data(), table->owned.size());
+        if (!out) {
+            cerr << "[Warning] Cannot write " << path << endl;
+            return;
         }
+        int64_t ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - tableStart).count();
+        cout << MaterialName(key) << ": " << counts[BB_WIN] << " won, " << counts[BB_DRAW] << " drawn, "
+             << counts[BB_LOSS] << " lost for the side to move, time: " << ms << " ms" << endl << flush;
+        built.Add(std::move(table));
     }
+
+    int loaded = bitbases.LoadDirectory(dir, BitbaseMaterials(BITBASE_MAX_PIECES));
+    int64_t ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    cout << "Bitbases: " << ordered.size() << " built, " << loaded << " loaded from " << dir << ", time: " << ms << " ms" << endl << flush;
 }
 
-void GenerateNonSlidingMoves(uint64_t pieces, const uint64_t attackTable[64], uint64_t own, vector<Move>& moves) {
-    while (pieces) {
-        int sq = __builtin_ctzll(pieces);
-        pieces &= pieces - 1;
+// setoption name <id> value <x>
+mutex statsMutex;
+EngineStats engineStats; // every game's searches and commands since startup or "stats reset"
+string statsFile; // "StatsFile" option, each finished game appends one JSON line here
 
-        uint64_t attacks = attackTable[sq];
-        attacks &= ~own;
+// Upper end of the bucket holding the given fraction of the samples
+uint64_t LatencyPercentile(const uint64_t (&histogram)[LATENCY_BUCKETS], double fraction) {
+    uint64_t samples = 0, seen = 0;
+    for (uint64_t count : histogram) samples += count;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += histogram[b];
+        if (samples && seen >= fraction * samples) return (2ULL << b) - 1;
+    }
+    return 0;
+}
 
-        while (attacks) {
-            int target = __builtin_ctzll(attacks);
-            attacks &= attacks - 1;
-            moves.push_back(Move(sq, target));
+// Estimated from the bucket midpoints
+double LatencyMean(const uint64_t (&histogram)[LATENCY_BUCKETS]) {
+    double sum = 0;
+    uint64_t samples = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        sum += histogram[b] * 1.5 * (1ULL << b);
+        samples += histogram[b];
+    }
+    return samples ? sum / samples : 0;
+}
+
+double Percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0;
+}
+
+// One line, sent as "info string" after every search
+string StatsSummary(const EngineStats& stats) {
+    uint64_t cutoffs = 0;
+    for (uint64_t count : stats.cutoffs) cutoffs += count;
+    ostringstream line;
+    line << fixed << setprecision(1) << "stats nodes " << stats.nodes << " qnodes " << stats.qnodes
+         << " tthit " << Percent(stats.ttHits, stats.ttProbes) << "% firstcut " << Percent(stats.cutoffs[0], cutoffs) << "%";
+    for (int phase = 0; phase < PHASE_NB; phase++) {
+        if (!stats.calls[phase]) continue;
+        line << " " << phaseNames[phase] << " " << stats.calls[phase] << "x" << (uint64_t)LatencyMean(stats.latency[phase]);
+    }
+    return line.str();
+}
+
+void PrintStats(const EngineStats& stats) {
+    uint64_t cutoffs = 0;
+    for (uint64_t count : stats.cutoffs) cutoffs += count;
+    cout << fixed << setprecision(1)
+         << "Nodes " << stats.nodes << " qnodes " << stats.qnodes
+         << " hash hits " << stats.ttHits << "/" << stats.ttProbes << " (" << Percent(stats.ttHits, stats.ttProbes) << "%)\n"
+         << "Beta cutoffs by move index:";
+    for (int i = 0; i < CUTOFF_SLOTS; i++) {
+        cout << " " << (i + 1) << (i == CUTOFF_SLOTS - 1 ? "+" : "") << ":" << Percent(stats.cutoffs[i], cutoffs) << "%";
+    }
+    cout << "\nPhase    |       calls | samples |    p50 |    p90 |    p99 | mean ticks | est. Mticks\n";
+    for (int phase = 0; phase < PHASE_NB; phase++) {
+        uint64_t samples = 0;
+        for (uint64_t count : stats.latency[phase]) samples += count;
+        double mean = LatencyMean(stats.latency[phase]);
+        cout << left << setw(8) << phaseNames[phase] << right << " | " << setw(11) << stats.calls[phase]
+             << " | " << setw(7) << samples
+             << " | " << setw(6) << LatencyPercentile(stats.latency[phase], 0.5)
+             << " | " << setw(6) << LatencyPercentile(stats.latency[phase], 0.9)
+             << " | " << setw(6) << LatencyPercentile(stats.latency[phase], 0.99)
+             << " | " << setw(10) << mean << " | " << setw(11) << stats.calls[phase] * mean / 1e6 << "\n";
+    }
+    cout << defaultfloat << flush;
+}
+
+// One JSON object on a single line, histograms as raw bucket counts
+string StatsJson(const EngineStats& stats, const string& game) {
+    auto array = [](const uint64_t* values, int count) {
+        string text = "[";
+        for (int i = 0; i < count; i++) text += (i ? "," : "") + to_string(values[i]);
+        return text + "]";
+    };
+    ostringstream json;
+    json << "{\"game\":\"" << game << "\",\"nodes\":" << stats.nodes << ",\"qnodes\":" << stats.qnodes
+         << ",\"ttProbes\":" << stats.ttProbes << ",\"ttHits\":" << stats.ttHits
+         << ",\"cutoffs\":" << array(stats.cutoffs, CUTOFF_SLOTS) << ",\"phases\":{";
+    for (int phase = 0; phase < PHASE_NB; phase++) {
+        json << (phase ? "," : "") << "\"" << phaseNames[phase] << "\":{\"calls\":" << stats.calls[phase]
+             << ",\"latency\":" << array(stats.latency[phase], LATENCY_BUCKETS) << "}";
+    }
+    json << "}}";
+    return json.str();
+}
+
+// Called when a game ends (ucinewgame, its server-mode quit or quit) with what the game counted
+void DumpGameStats(const EngineStats& stats, const string& game) {
+    lock_guard<mutex> lock(statsMutex);
+    if (statsFile.empty() || (!stats.nodes && !stats.calls[PHASE_MAKE])) return;
+    ofstream file(statsFile, ios::app);
+    if (file) file << StatsJson(stats, game) << "\n";
+    else cerr << "[Warning] Could not write statistics to " << statsFile << endl;
+}
+
+void SetOption(const string& line) {
+    istringstream iss(line);
+    string token, name, value;
+    iss >> token >> token;
+    while (iss >> token && token != "value") name += (name.empty() ? "" : " ") + token;
+    getline(iss >> ws, value);
+
+    if (name == "Hash") {
+        TT.resize(max(1, min(65536, stoi(value))));
+    } else if (name == "Threads") {
+        searchThreads = max(1, min(MAX_THREADS, stoi(value)));
+    } else if (name == "EvalFile") {
+        if (value.empty() || value == "<empty>") {
+            nnueNet.reset();
+        } else if (LoadNetwork(value)) {
+            cout << "info string Loaded NNUE " << value << " (" << nnueKernel << " kernels)" << endl;
+        } else {
+            cerr << "[Warning] Could not load NNUE from " << value << ", keeping the current evaluation" << endl;
         }
+    } else if (name == "UseNNUE") {
+        useNnue = value == "true";
+    } else if (name == "BookFile") {
+        if (value.empty() || value == "<empty>") openingBook.Close();
+        else if (!openingBook.Open(value)) cerr << "[Warning] Could not open book " << value << endl;
+    } else if (name == "BookDepth") {
+        openingBook.maxPly = max(0, stoi(value));
+    } else if (name == "StatsFile") {
+        lock_guard<mutex> lock(statsMutex);
+        statsFile = value == "<empty>" ? "" : value;
+    } else if (name == "BitbasePath") {
+        if (value.empty() || value == "<empty>") {
+            bitbases.Clear();
+        } else {
+            int loaded = bitbases.LoadDirectory(value, BitbaseMaterials(BITBASE_MAX_PIECES));
+            cout << "info string Loaded " << loaded << " bitbases from " << value << endl;
+        }
+    } else {
+        cerr << "[Warning] Unknown option: " << name << endl;
+    }
+}
+
+string extractFen(const string& input) {
+    if (input.rfind("initial startpos") == 0) {
+        return START_FEN;
     }
+    const string prefix = "initial ";
+    size_t start = input.find(prefix);
+    if (start == string::npos) return "";
+
+    start += prefix.size();
+    return input.substr(start);
 }
 
+// Squares and an optional promotion piece, the shape ParseMove expects
+bool IsUciMove(string_view uci) {
+    return (uci.size() == 4 || (uci.size() == 5 && uci[4] && strchr("nbrq", uci[4])))
+        && uci[0] >= 'a' && uci[0] <= 'h' && uci[1] >= '1' && uci[1] <= '8'
+        && uci[2] >= 'a' && uci[2] <= 'h' && uci[3] >= '1' && uci[3] <= '8';
+}
 
-void GeneratePawnMoves(uint64_t pawns, uint64_t enemy, uint64_t all, vector<Move>& moves, Color color, uint8_t epSquare = 64) {
-    int forward = (color == WHITE) ? 8 : -8;
-    int startRank = (color == WHITE) ? 1 : 6;
-    int promotionRank = (color == WHITE) ? 6 : 1;
+// Whether a move already on the board's stack is the one the UCI string names
+bool SameMove(Move move, string_view uci) {
+    int from = (uci[1] - '1') * 8 + (uci[0] - 'a');
+    int to = (uci[3] - '1') * 8 + (uci[2] - 'a');
+    if (move.from() != from || move.to() != to || move.isPromotion() != (uci.size() == 5)) return false;
+    return !move.isPromotion() || move.promotion() == charToPiece(uci[4]);
+}
 
-    while (pawns) {
-        int sq = __builtin_ctzll(pawns);
-        pawns &= pawns - 1;
+// position [startpos | fen <fen>] [moves <m1> <m2> ...]
+// The board's move stack is compared with the new list. Moves after the first difference are taken back
+// and only the rest of the list is played, so a game in progress costs one move per command. The board is
+// rebuilt from the FEN only when the start position itself changes
+void SetPosition(Board& board, string& baseFen, string_view line) {
+    size_t movesAt = line.find(" moves");
+    string_view setup = line.substr(0, movesAt);
+    setup.remove_prefix(min(setup.size(), setup.find_first_not_of(' ', 8)));
 
-        int rank = sq >> 3;
+    string_view fen;
+    if (setup.rfind("startpos", 0) == 0) {
+        fen = START_FEN;
+    } else if (setup.rfind("fen ", 0) == 0) {
+        fen = setup.substr(4);
+        fen.remove_suffix(fen.size() - fen.find_last_not_of(' ') - 1);
+    } else {
+        cerr << "[Warning] position needs startpos or fen" << endl;
+        return;
+    }
+    if (fen != baseFen) {
+        baseFen.assign(fen);
+        board.setBB(baseFen);
+    }
 
-        int oneStep = sq + forward;
-        if (oneStep >= 0 && oneStep < 64 && !(all & bitMasks[oneStep])) {
-            if (rank == promotionRank) {
-                moves.push_back(Move(sq, oneStep, 'q'));
-                moves.push_back(Move(sq, oneStep, 'r'));
-                moves.push_back(Move(sq, oneStep, 'b'));
-                moves.push_back(Move(sq, oneStep, 'n'));
-            } else {
-                moves.push_back(Move(sq, oneStep));
+    size_t ply = 0;
+    size_t pos = movesAt == string_view::npos ? line.size() : movesAt + 6;
+    while ((pos = line.find_first_not_of(' ', pos)) != string_view::npos) {
+        size_t end = min(line.size(), line.find(' ', pos));
+        string_view token = line.substr(pos, end - pos);
+        pos = end;
 
-                if (rank == startRank) {
-                    int twoStep = sq + 2 * forward;
-                    if (!(all & bitMasks[twoStep])) {
-                        moves.push_back(Move(sq, twoStep));
-                    }
+        if (!IsUciMove(token)) {
+            cerr << "[Warning] Bad move in position: " << token << endl;
+            break;
+        }
+        if (ply < board.history.size()) {
+            if (SameMove(board.history[ply].move, token)) {
+                ply++;
+                continue;
+            }
+            while (board.history.size() > ply) board.unmake_move();
+        }
+
+        Move move = ParseMove(board, token);
+        if (!IsLegalMove(board, ComputeCheckInfo(board, board.whiteToMove ? WHITE : BLACK), move)) {
+            cerr << "[Warning] Illegal move in position: " << token << endl;
+            break;
+        }
+        board.make_move(move);
+        ply++;
+    }
+    while (board.history.size() > ply) board.unmake_move();
+}
+
+// One position of an EPD file with the opcodes batch analysis uses
+struct EpdPosition {
+    string fen;
+    string id;
+    string expected; // the bm/am operations as written, for the report
+    vector<Move> best; // bm
+    vector<Move> avoid; // am
+};
+
+// Reads "<pieces> <side> <castling> <ep> [halfmove fullmove] [opcode operands;]...", FEN lines included.
+// Moves are SAN as EPD requires, UCI is accepted too. Sets board to the position; false if there is none
+bool ParseEpd(const string& line, Board& board, EpdPosition& position) {
+    istringstream iss(line);
+    string fields[4];
+    for (string& field : fields) {
+        if (!(iss >> field)) return false;
+    }
+    string rest;
+    getline(iss >> ws, rest);
+
+    string clocks = "0 1";
+    istringstream numbers(rest);
+    int halfmove, fullmove;
+    if (numbers >> halfmove >> fullmove) {
+        clocks = to_string(halfmove) + " " + to_string(fullmove);
+        getline(numbers >> ws, rest);
+    }
+    position.fen = fields[0] + " " + fields[1] + " " + fields[2] + " " + fields[3] + " " + clocks;
+    board.setBB(position.fen);
+    if (__builtin_popcountll(board.bitboard(WHITE, KING)) != 1 || __builtin_popcountll(board.bitboard(BLACK, KING)) != 1)
+        return false;
+
+    // Operations end at semicolons outside quoted strings
+    vector<string> operations(1);
+    bool quoted = false;
+    for (char c : rest) {
+        if (c == '"') quoted = !quoted;
+        if (c == ';' && !quoted) operations.emplace_back();
+        else operations.back() += c;
+    }
+    for (const string& operation : operations) {
+        istringstream ops(operation);
+        string opcode, operand;
+        ops >> opcode;
+        if (opcode == "id") {
+            getline(ops >> ws, position.id);
+            position.id.erase(remove(position.id.begin(), position.id.end(), '"'), position.id.end());
+        } else if (opcode == "bm" || opcode == "am") {
+            position.expected += (position.expected.empty() ? "" : " ") + opcode;
+            while (ops >> operand) {
+                Move move = ParseSan(board, operand);
+                if (move == NO_MOVE && IsUciMove(operand)) {
+                    move = ParseMove(board, operand);
+                    if (!IsLegalMove(board, ComputeCheckInfo(board, board.whiteToMove ? WHITE : BLACK), move)) move = NO_MOVE;
                 }
+                if (move == NO_MOVE) cerr << "[Warning] Unreadable " << opcode << " move " << operand << " in: " << line << endl;
+                else (opcode == "bm" ? position.best : position.avoid).push_back(move);
+                position.expected += " " + operand;
             }
         }
+    }
+    return true;
+}
 
-        uint64_t attacks = pawnAttacks[color][sq];
-        uint64_t normalCaptures = attacks & enemy;
+// analyze-epd <file> [depth N] [nodes N] [movetime MS] [threads T]
+// One thread reads the file and hands positions to the workers. Each worker searches one position at a time on
+// a single thread with move ordering history of its own, cleared for every position. The hash table is shared.
+// Results are printed as positions finish; positions with bm or am are scored, and the time a solution was
+// found is when the search settled on an accepted move for good
+void AnalyzeEpd(const string& path, const SearchLimits& limits, int threadCount) {
+    auto start = chrono::steady_clock::now();
+    ifstream epd(path);
+    if (!epd) {
+        cerr << "[Warning] Cannot open " << path << endl;
+        return;
+    }
+    TT.clear();
 
-        while (normalCaptures) {
-            int targetSq = __builtin_ctzll(normalCaptures);
-            normalCaptures &= normalCaptures - 1;
+    mutex queueMutex;
+    condition_variable changed;
+    deque<pair<size_t, string>> lines; // position number and line
+    bool finished = false;
+    atomic<uint64_t> analyzed{0}, nodes{0};
+    mutex resultMutex;
+    size_t scored = 0;
+    vector<int64_t> solveTimes;
 
-            if (rank == promotionRank) {
-                moves.push_back(Move(sq, targetSq, 'q'));
-                moves.push_back(Move(sq, targetSq, 'r'));
-                moves.push_back(Move(sq, targetSq, 'b'));
-                moves.push_back(Move(sq, targetSq, 'n'));
-            } else {
-                moves.push_back(Move(sq, targetSq));
+    auto worker = [&] {
+        Board board;
+        vector<unique_ptr<SearchHistory>> histories;
+        while (true) {
+            pair<size_t, string> item;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                changed.wait(lock, [&] { return finished || !lines.empty(); });
+                if (lines.empty()) return;
+                item = std::move(lines.front());
+                lines.pop_front();
+            }
+            changed.notify_all();
+
+            EpdPosition position;
+            if (!ParseEpd(item.second, board, position)) {
+                cerr << "[Warning] Not a position: " << item.second << endl;
+                continue;
             }
+            ClearSearchHistory(histories);
+            SearchShared shared(limits, board.whiteToMove);
+            vector<pair<int64_t, Move>> iterations;
+            shared.iterations = &iterations;
+            SearchResult result = SearchPosition(board, shared, histories, 1);
+            analyzed++;
+            nodes += result.nodes;
+
+            auto accepted = [&](Move move) {
+                bool best = position.best.empty() || find(position.best.begin(), position.best.end(), move) != position.best.end();
+                return best && find(position.avoid.begin(), position.avoid.end(), move) == position.avoid.end();
+            };
+            bool scoredPosition = !position.best.empty() || !position.avoid.empty();
+            bool solved = scoredPosition && result.move != NO_MOVE && accepted(result.move);
+            int64_t solvedMs = result.timeMs;
+            for (auto it = iterations.rbegin(); solved && it != iterations.rend() && accepted(it->second); ++it) solvedMs = it->first;
+
+            ostringstream line;
+            line << "epd " << item.first;
+            if (!position.id.empty()) line << " id \"" << position.id << "\"";
+            line << " bestmove " << (result.move == NO_MOVE ? "0000" : moveToString(result.move)) << " score " << ScoreToUci(result.score)
+                 << " depth " << result.depth << " nodes " << result.nodes << " time " << result.timeMs;
+            if (scoredPosition) {
+                line << " " << position.expected;
+                if (solved) line << " solved " << solvedMs;
+                else line << " failed";
+            }
+            EmitLine(line.str());
+
+            lock_guard<mutex> lock(resultMutex);
+            if (scoredPosition) scored++;
+            if (solved) solveTimes.push_back(solvedMs);
         }
+    };
+    vector<thread> workers;
+    for (int i = 0; i < threadCount; i++) workers.emplace_back(worker);
 
-        if (epSquare < 64) {
-            uint64_t epBB = bitMasks[epSquare];
-            if ((attacks & epBB) != 0) {
-                moves.push_back(Move(sq, epSquare, 0, true));
+    string line;
+    size_t count = 0;
+    while (getline(epd, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.find_first_not_of(" \t") == string::npos || line[0] == '#') continue;
+        unique_lock<mutex> lock(queueMutex);
+        changed.wait(lock, [&] { return lines.size() < (size_t)threadCount * 4; });
+        lines.emplace_back(++count, std::move(line));
+        changed.notify_all();
+    }
+    {
+        lock_guard<mutex> lock(queueMutex);
+        finished = true;
+    }
+    changed.notify_all();
+    for (thread& t : workers) t.join();
+
+    int64_t ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    ostringstream summary;
+    summary << "Positions: " << analyzed << ", nodes: " << nodes << ", time: " << ms << " ms, nps: " << nodes * 1000 / max<int64_t>(ms, 1);
+    if (scored) {
+        summary << fixed << setprecision(1) << "\nSolved: " << solveTimes.size() << "/" << scored
+                << " (" << 100.0 * solveTimes.size() / scored << "%)\nSolved within ";
+        int64_t slowest = solveTimes.empty() ? 0 : *max_element(solveTimes.begin(), solveTimes.end());
+        for (int64_t limit = 10; ; limit *= 10) {
+            for (int64_t step : {limit, limit * 3}) {
+                size_t within = count_if(solveTimes.begin(), solveTimes.end(), [step](int64_t t) { return t <= step; });
+                summary << (step > 10 ? ", " : "") << step << " ms: " << within;
             }
+            if (limit * 3 >= slowest) break;
         }
     }
+    EmitLine(summary.str());
 }
 
-vector<Move> GeneratePseudoLegalMoves(Board& board, bool isWhiteToMove) {
-    vector<Move> moves;
-    moves.reserve(256);
-    uint8_t epTarget = board.hasEnPassant() ? board.getEnPassantTarget() : 64;
+#ifdef __linux__
+// An engine speaking this engine's protocol from a child process, over a pipe each way
+class EngineProcess {
+public:
+    ~EngineProcess() { Stop(); }
 
-    if (isWhiteToMove) {
-        GenerateSlidingMoves(board.whiteBishops, bishopDirs, std::size(bishopDirs), board.whitePieces, board.blackPieces, moves);
-        GenerateSlidingMoves(board.whiteRooks,   rookDirs,   std::size(rookDirs),   board.whitePieces, board.blackPieces, moves);
-        GenerateSlidingMoves(board.whiteQueens,  queenDirs,  std::size(queenDirs),  board.whitePieces, board.blackPieces, moves);
-        GenerateNonSlidingMoves(board.whiteKnights, knightAttacks, board.whitePieces, moves);
-        GenerateNonSlidingMoves(board.whiteKing, kingAttacks, board.whitePieces, moves);
-        GeneratePawnMoves(board.whitePawns, board.blackPieces, board.allPieces, moves, WHITE, epTarget);
-        if (!board.is_king_in_check(true)) GenerateCastlingMoves(board.whiteKing, board.whiteRooks, board.castlingRights, board.allPieces, moves, WHITE, board.whiteAttacks, board.blackAttacks);
-    } else {
-        GenerateSlidingMoves(board.blackBishops, bishopDirs, std::size(bishopDirs), board.blackPieces, board.whitePieces, moves);
-        GenerateSlidingMoves(board.blackRooks,   rookDirs,   std::size(rookDirs),   board.blackPieces, board.whitePieces, moves);
-        GenerateSlidingMoves(board.blackQueens,  queenDirs,  std::size(queenDirs),  board.blackPieces, board.whitePieces, moves);
-        GenerateNonSlidingMoves(board.blackKnights, knightAttacks, board.blackPieces, moves);
-        GenerateNonSlidingMoves(board.blackKing, kingAttacks, board.blackPieces, moves);
-        GeneratePawnMoves(board.blackPawns, board.whitePieces, board.allPieces, moves, BLACK, epTarget);
-        if (!board.is_king_in_check(false)) GenerateCastlingMoves(board.blackKing, board.blackRooks, board.castlingRights, board.allPieces, moves, BLACK, board.whiteAttacks, board.blackAttacks);
-    }
-
-    return moves;
-};
-
-vector<Move> GenerateLegalMoves(Board& board) {
-    vector<Move> pseudoMoves = GeneratePseudoLegalMoves(board, board.whiteToMove);
-    vector<Move> legalMoves;
-    legalMoves.reserve(pseudoMoves.size());
-
-    for (const Move& move : pseudoMoves) {
-        Board temp = board;
-        //cout << "[TIME] ---- " << indexToSquare(move.from) << indexToSquare(move.to);
-        if (move.promotion != 0) {
-            //cout << (char)move.promotion;
-        }
-        //cout << " ----" << endl;
-        //cout << "[TIME] White pieces: " << temp.whitePieces << endl;
-        //cout << "[TIME] Black pieces: " << temp.blackPieces << endl;
-        //cout << "[TIME] White attacks: " << temp.whiteAttacks << endl;
-        //cout << "[TIME] Black attacks: " << temp.blackAttacks << endl;
-        //cout << "[TIME] White King pos: " << to_string(temp.whiteKingPos) << ", " << temp.whiteKing << endl;
-        //cout << "[TIME] Black King pos: " << to_string(temp.blackKingPos) << ", " << temp.blackKing << endl;
-        //cout << endl;
-        //cout << "[TIME] White pawns: " << temp.whitePawns << endl;
-        //cout << "[TIME] Black pawns: " << temp.blackPawns << endl;
-        //cout << "[TIME] White bishops: " << temp.whiteBishops << endl;
-        //cout << "[TIME] Black bishops: " << temp.blackBishops << endl;
-        //cout << "[TIME] White knights: " << temp.whiteKnights << endl;
-        //cout << "[TIME] Black knights: " << temp.blackKnights << endl;
-        //cout << "[TIME] White rooks: " << temp.whiteRooks << endl;
-        //cout << "[TIME] Black rooks: " << temp.blackRooks << endl;
-        //cout << "[TIME] White queens: " << temp.whiteQueens << endl;
-        //cout << "[TIME] Black queens: " << temp.blackQueens << endl;
-        //cout << endl;
-        //cout << "[TIME] All pieces: " << temp.allPieces << endl;
-        //cout << endl;
-        //cout << flush;
-        temp.make_move(move);
-        if (!temp.is_king_in_check(!temp.whiteToMove)) { // check if own king is not in check
-            legalMoves.push_back(move);
-        }
-    }
-
-    return legalMoves;
+    bool Start(const string& path) {
+        int toChild[2], fromChild[2];
+        if (pipe2(toChild, O_CLOEXEC) != 0) return false;
+        if (pipe2(fromChild, O_CLOEXEC) != 0) {
+            close(toChild[0]);
+            close(toChild[1]);
+            return false;
+        }
+        pid = fork();
+        if (pid == 0) {
+            dup2(toChild[0], STDIN_FILENO);
+            dup2(fromChild[1], STDOUT_FILENO);
+            execl(path.c_str(), path.c_str(), (char*)nullptr);
+            _exit(127);
+        }
+        close(toChild[0]);
+        close(fromChild[1]);
+        input = toChild[1];
+        output = fromChild[0];
+        if (pid < 0) Stop();
+        return pid > 0;
+    }
+
+    void Stop() {
+        if (input >= 0) {
+            Send("quit");
+            close(input);
+            close(output);
+            input = output = -1;
+        }
+        if (pid > 0) {
+            for (int i = 0; i < 100 && waitpid(pid, nullptr, WNOHANG) == 0; i++) this_thread::sleep_for(chrono::milliseconds(10));
+            if (kill(pid, 0) == 0 && waitpid(pid, nullptr, WNOHANG) == 0) {
+                kill(pid, SIGKILL);
+                waitpid(pid, nullptr, 0);
+            }
+        }
+        pid = -1;
+        buffer.clear();
+    }
+
+    bool Send(const string& line) {
+        string data = line + "\n";
+        for (size_t done = 0; done < data.size(); ) {
+            ssize_t written = write(input, data.data() + done, data.size() - done);
+            if (written <= 0) return false;
+            done += written;
+        }
+        return true;
+    }
+
+    // Next output line, false at end of file or when none arrived within timeoutMs
+    bool ReadLine(string& line, int64_t timeoutMs) {
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(max<int64_t>(timeoutMs, 0));
+        while (true) {
+            size_t newline = buffer.find('\n');
+            if (newline != string::npos) {
+                line = buffer.substr(0, newline);
+                buffer.erase(0, newline + 1);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                return true;
+            }
+            int64_t left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+            if (left < 0) return false;
+            pollfd ready{output, POLLIN, 0};
+            int events = poll(&ready, 1, (int)min<int64_t>(left, INT_MAX));
+            if (events < 0 && errno == EINTR) continue;
+            if (events <= 0) return false;
+            char chunk[4096];
+            ssize_t count = read(output, chunk, sizeof(chunk));
+            if (count <= 0) return false;
+            buffer.append(chunk, count);
+        }
+    }
+
+    // Skips output up to a line starting with prefix
+    bool WaitFor(const string& prefix, int64_t timeoutMs, string* found = nullptr) {
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+        string line;
+        while (ReadLine(line, chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count())) {
+            if (line.rfind(prefix, 0) != 0) continue;
+            if (found) *found = line;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    pid_t pid = -1;
+    int input = -1, output = -1;
+    string buffer;
+};
+#endif
+
+// One side of a match: an engine binary and the options it is given
+struct MatchEngine {
+    string name;
+    string path;
+    vector<pair<string, string>> options;
+};
+
+struct MatchSettings {
+    int games = 100;
+    int concurrency = 1;
+    int64_t baseMs = 10000, incMs = 100;
+    vector<string> openings; // FENs, each played twice with colors reversed
+    string pgnPath;
+    bool sprt = false;
+    double elo0 = 0, elo1 = 5, alpha = 0.05, beta = 0.05;
+    MatchEngine engines[2];
+};
+
+constexpr int RESIGN_SCORE = 1000; // both engines agree on at least this for RESIGN_PLIES plies in a row
+constexpr int RESIGN_PLIES = 6;
+constexpr int DRAW_SCORE = 10; // from ply DRAW_START on, both engines within this of 0 for DRAW_PLIES plies
+constexpr int DRAW_PLIES = 10;
+constexpr int DRAW_START = 80;
+constexpr int MAX_GAME_PLIES = 600;
+
+bool IsInsufficientMaterial(const Board& board) {
+    uint64_t heavy = 0, minors = 0;
+    for (int color = WHITE; color <= BLACK; color++) {
+        heavy |= board.bitboard(color, PAWN) | board.bitboard(color, ROOK) | board.bitboard(color, QUEEN);
+        minors |= board.bitboard(color, KNIGHT) | board.bitboard(color, BISHOP);
+    }
+    return !heavy && __builtin_popcountll(minors) <= 1;
 }
 
+// Win, draw and loss counts of the first engine, with the Elo estimate and the SPRT log-likelihood ratio.
+// Uses the trinomial normal approximation: score s per game, variance var of a single game's score
+struct MatchScore {
+    int wins = 0, draws = 0, losses = 0;
 
-string extractFen(const string& input) {
-    if (input.rfind("initial startpos") == 0) {
-        return "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+    int games() const { return wins + draws + losses; }
+
+    double Mean() const { return games() ? (wins + 0.5 * draws) / games() : 0.5; }
+
+    double Variance() const {
+        double s = Mean();
+        return games() ? (wins * (1 - s) * (1 - s) + draws * (0.5 - s) * (0.5 - s) + losses * s * s) / games() : 0;
     }
-    const string prefix = "initial ";
-    size_t start = input.find(prefix);
-    if (start == string::npos) return "";
 
-    start += prefix.size();
-    return input.substr(start);
+    static double Elo(double score) {
+        score = min(max(score, 1e-3), 1 - 1e-3);
+        return 400 * log10(score / (1 - score));
+    }
+
+    static double ScoreOf(double elo) {
+        return 1 / (1 + pow(10, -elo / 400));
+    }
+
+    // Half the width of the 95% interval
+    double EloError() const {
+        if (!games()) return 0;
+        double margin = 1.96 * sqrt(Variance() / games());
+        return (Elo(Mean() + margin) - Elo(Mean() - margin)) / 2;
+    }
+
+    double Llr(double elo0, double elo1) const {
+        double var = Variance();
+        if (var <= 0) return 0;
+        double s0 = ScoreOf(elo0), s1 = ScoreOf(elo1);
+        return (s1 - s0) * (2 * Mean() - s0 - s1) * games() / (2 * var);
+    }
+};
+
+#ifdef __linux__
+struct PlayedGame {
+    string result = "*"; // PGN result
+    string termination;
+    vector<string> san;
+    bool restart[2] = {}; // by color: the engine did not answer and has to be replaced
+};
+
+// Starts the engine and sends its options, waiting until it is ready
+bool StartEngine(EngineProcess& process, const MatchEngine& engine) {
+    if (!process.Start(engine.path) || !process.Send("uci") || !process.WaitFor("uciok", 10000)) return false;
+    for (const auto& option : engine.options) process.Send("setoption name " + option.first + " value " + option.second);
+    return process.Send("isready") && process.WaitFor("readyok", 60000);
+}
+
+// Plays one game from fen between players[WHITE] and players[BLACK] on the match clock.
+// The referee keeps its own board: it rejects illegal moves and ends the game by the rules or by adjudication
+PlayedGame PlayGame(EngineProcess* players[2], const string& fen, const MatchSettings& settings) {
+    PlayedGame game;
+    Board board;
+    board.setBB(fen);
+    for (int color = WHITE; color <= BLACK; color++) {
+        players[color]->Send("ucinewgame");
+        players[color]->Send("isready");
+        if (!players[color]->WaitFor("readyok", 10000)) game.restart[color] = true;
+    }
+
+    int64_t clock[2] = {settings.baseMs, settings.baseMs};
+    string moves;
+    int winPlies[2] = {0, 0}, drawPlies = 0;
+    auto finish = [&game](const string& result, const string& termination) {
+        game.result = result;
+        game.termination = termination;
+    };
+    auto loss = [](int color) { return color == WHITE ? "0-1" : "1-0"; };
+
+    for (int ply = 0; game.result == "*"; ply++) {
+        int us = board.whiteToMove ? WHITE : BLACK;
+        MoveList legal;
+        GenerateLegalMoves(board, legal);
+        if (game.restart[WHITE] || game.restart[BLACK]) finish(loss(game.restart[WHITE] ? WHITE : BLACK), "engine failure");
+        else if (legal.empty()) finish(board.is_king_in_check(board.whiteToMove) ? loss(us) : "1/2-1/2", board.is_king_in_check(board.whiteToMove) ? "checkmate" : "stalemate");
+        else if (board.IsFiftyMoveDraw()) finish("1/2-1/2", "fifty-move rule");
+        else if (board.RepetitionCount() >= 2) finish("1/2-1/2", "threefold repetition");
+        else if (IsInsufficientMaterial(board)) finish("1/2-1/2", "insufficient material");
+        else if (ply >= MAX_GAME_PLIES) finish("1/2-1/2", "adjudication: game length");
+        if (game.result != "*") break;
+
+        EngineProcess& engine = *players[us];
+        engine.Send("position fen " + fen + (moves.empty() ? "" : " moves" + moves));
+        engine.Send("go wtime " + to_string(clock[WHITE]) + " btime " + to_string(clock[BLACK])
+                    + " winc " + to_string(settings.incMs) + " binc " + to_string(settings.incMs));
+        auto start = chrono::steady_clock::now();
+        string line, bestmove;
+        int score = 0;
+        bool scored = false;
+        while (engine.ReadLine(line, clock[us] + 1000 - chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count())) {
+            istringstream iss(line);
+            string token;
+            iss >> token;
+            if (token == "bestmove") {
+                iss >> bestmove;
+                break;
+            }
+            if (token != "info") continue;
+            while (iss >> token) {
+                if (token != "score") continue;
+                string kind;
+                iss >> kind >> score;
+                if (kind == "mate") score = score > 0 ? MATE_SCORE - score : -MATE_SCORE - score;
+                scored = kind == "cp" || kind == "mate";
+            }
+        }
+        clock[us] -= chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        if (bestmove.empty()) {
+            // Still thinking or gone: it loses on time and is stopped or replaced before the next game
+            engine.Send("stop");
+            if (!engine.WaitFor("bestmove", 2000)) game.restart[us] = true;
+            finish(loss(us), "time forfeit");
+            break;
+        }
+        if (clock[us] < 0) {
+            finish(loss(us), "time forfeit");
+            break;
+        }
+        clock[us] += settings.incMs;
+
+        Move move = IsUciMove(bestmove) ? ParseMove(board, bestmove) : NO_MOVE;
+        if (move == NO_MOVE || !IsLegalMove(board, ComputeCheckInfo(board, (Color)us), move)) {
+            finish(loss(us), "illegal move " + bestmove);
+            break;
+        }
+        game.san.push_back(MoveToSan(board, move));
+        board.make_move(move);
+        moves += " " + bestmove;
+
+        // Adjudication needs both engines to agree over several plies; book moves carry no score
+        int whiteScore = us == WHITE ? score : -score;
+        winPlies[WHITE] = scored && whiteScore >= RESIGN_SCORE ? winPlies[WHITE] + 1 : 0;
+        winPlies[BLACK] = scored && whiteScore <= -RESIGN_SCORE ? winPlies[BLACK] + 1 : 0;
+        drawPlies = scored && ply >= DRAW_START && abs(whiteScore) <= DRAW_SCORE ? drawPlies + 1 : 0;
+        if (winPlies[WHITE] >= RESIGN_PLIES) finish("1-0", "adjudication: score");
+        else if (winPlies[BLACK] >= RESIGN_PLIES) finish("0-1", "adjudication: score");
+        else if (drawPlies >= DRAW_PLIES) finish("1/2-1/2", "adjudication: draw score");
+    }
+    return game;
+}
+
+string FormatPgn(const PlayedGame& game, const MatchSettings& settings, int round, const string& white, const string& black, const string& fen) {
+    time_t now = time(nullptr);
+    char date[16];
+    strftime(date, sizeof(date), "%Y.%m.%d", localtime(&now));
+    ostringstream timeControl;
+    timeControl << settings.baseMs / 1000.0 << "+" << settings.incMs / 1000.0;
+
+    ostringstream pgn;
+    pgn << "[Event \"NeptuneBot match\"]\n[Site \"local\"]\n[Date \"" << date << "\"]\n[Round \"" << round << "\"]\n"
+        << "[White \"" << white << "\"]\n[Black \"" << black << "\"]\n[Result \"" << game.result << "\"]\n"
+        << "[TimeControl \"" << timeControl.str() << "\"]\n[Termination \"" << game.termination << "\"]\n";
+    if (fen != START_FEN) pgn << "[SetUp \"1\"]\n[FEN \"" << fen << "\"]\n";
+    pgn << "\n";
+
+    Board board;
+    board.setBB(fen);
+    int moveNumber = board.fullmoveNumber;
+    bool whiteMove = board.whiteToMove;
+    string text, lineText;
+    for (size_t i = 0; i < game.san.size(); i++) {
+        string token = whiteMove ? to_string(moveNumber) + ". " + game.san[i] : (i == 0 ? to_string(moveNumber) + "... " : "") + game.san[i];
+        if (!whiteMove) moveNumber++;
+        whiteMove = !whiteMove;
+        if (lineText.size() + token.size() + 1 > 79) {
+            text += lineText + "\n";
+            lineText.clear();
+        }
+        lineText += (lineText.empty() ? "" : " ") + token;
+    }
+    if (lineText.size() + game.result.size() + 1 > 79) {
+        text += lineText + "\n";
+        lineText.clear();
+    }
+    text += lineText + (lineText.empty() ? "" : " ") + game.result + "\n";
+    pgn << text << "\n";
+    return pgn.str();
+}
+
+// match [games N] [tc <base>+<inc>] [concurrency T] [openings <file>] [pgn <file>] [sprt <elo0> <elo1>]
+//       [engine1 <path>] [engine2 <path>] [option1 <name>=<value>]... [option2 <name>=<value>]...
+// Every worker thread runs one game at a time between its own two engine processes, so T games are
+// played at once. Each opening is played twice with colors reversed. Results are counted for engine1
+void RunMatch(const MatchSettings& settings) {
+    signal(SIGPIPE, SIG_IGN); // a crashed engine must not take the match down with it
+    auto start = chrono::steady_clock::now();
+    atomic<int> nextGame{0};
+    atomic<bool> finished{false};
+    mutex resultMutex;
+    MatchScore score;
+    ofstream pgn;
+    if (!settings.pgnPath.empty()) {
+        pgn.open(settings.pgnPath, ios::app);
+        if (!pgn) cerr << "[Warning] Cannot write " << settings.pgnPath << endl;
+    }
+    double lower = log(settings.beta / (1 - settings.alpha)), upper = log((1 - settings.beta) / settings.alpha);
+
+    auto worker = [&] {
+        EngineProcess processes[2];
+        for (int i = 0; i < 2; i++) {
+            if (!StartEngine(processes[i], settings.engines[i])) {
+                cerr << "[Warning] Cannot start " << settings.engines[i].path << endl;
+                finished = true;
+                return;
+            }
+        }
+        for (int index = nextGame++; index < settings.games && !finished; index = nextGame++) {
+            int first = index % 2; // engine playing White
+            const string& fen = settings.openings[(index / 2) % settings.openings.size()];
+            EngineProcess* players[2] = {&processes[first], &processes[1 - first]};
+            PlayedGame game = PlayGame(players, fen, settings);
+            for (int color = WHITE; color <= BLACK; color++) {
+                if (!game.restart[color]) continue;
+                int engine = color == WHITE ? first : 1 - first;
+                processes[engine].Stop();
+                if (!StartEngine(processes[engine], settings.engines[engine])) finished = true;
+            }
+
+            lock_guard<mutex> lock(resultMutex);
+            if (pgn) pgn << FormatPgn(game, settings, index + 1, settings.engines[first].name, settings.engines[1 - first].name, fen) << flush;
+            bool firstWhite = first == 0;
+            if (game.result == "1/2-1/2") score.draws++;
+            else if ((game.result == "1-0") == firstWhite) score.wins++;
+            else score.losses++;
+
+            ostringstream line;
+            line << fixed << setprecision(1) << "Game " << index + 1 << " " << settings.engines[first].name << " - "
+                 << settings.engines[1 - first].name << " " << game.result << " (" << game.termination << ") | "
+                 << score.wins << "-" << score.losses << "-" << score.draws << " elo " << MatchScore::Elo(score.Mean())
+                 << " +- " << score.EloError();
+            if (settings.sprt) {
+                double llr = score.Llr(settings.elo0, settings.elo1);
+                line << setprecision(2) << " llr " << llr << " [" << lower << ", " << upper << "]";
+                if (!finished && (llr <= lower || llr >= upper)) {
+                    line << (llr >= upper ? " H1 accepted" : " H0 accepted");
+                    finished = true;
+                }
+            }
+            EmitLine(line.str());
+        }
+    };
+    vector<thread> workers;
+    for (int i = 0; i < settings.concurrency; i++) workers.emplace_back(worker);
+    for (thread& t : workers) t.join();
+
+    int64_t ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    ostringstream summary;
+    summary << fixed << setprecision(1) << "Match " << settings.engines[0].name << " vs " << settings.engines[1].name << ": "
+            << score.wins << " wins, " << score.losses << " losses, " << score.draws << " draws in " << ms / 1000.0 << " s, elo "
+            << MatchScore::Elo(score.Mean()) << " +- " << score.EloError();
+    if (settings.sprt) summary << setprecision(2) << ", llr " << score.Llr(settings.elo0, settings.elo1);
+    EmitLine(summary.str());
+}
+#endif
+
+// Fixed set of threads running the searches of server-mode games in the order their go commands arrived.
+// A game's clock starts at its go command, so time spent queued counts against that game's own budget
+// and no game can hold a worker longer than its budget allows
+class SearchPool {
+public:
+    ~SearchPool() {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (thread& worker : workers) worker.join();
+    }
+
+    future<void> Submit(function<void()> job) {
+        packaged_task<void()> task(std::move(job));
+        future<void> done = task.get_future();
+        {
+            lock_guard<mutex> lock(queueMutex);
+            if (workers.empty()) {
+                int count = max(1u, thread::hardware_concurrency());
+                for (int i = 0; i < count; i++) workers.emplace_back([this] { Work(); });
+            }
+            queue.push_back(std::move(task));
+        }
+        ready.notify_one();
+        return done;
+    }
+
+private:
+    void Work() {
+        while (true) {
+            packaged_task<void()> task;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                ready.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            task();
+        }
+    }
+
+    mutex queueMutex;
+    condition_variable ready;
+    deque<packaged_task<void()>> queue;
+    vector<thread> workers;
+    bool stopping = false;
+};
+
+SearchPool searchPool;
+
+// Everything that belongs to one game: its board and move stack, move-ordering history and running search.
+// The plain command loop drives one session; "game <id> <command>" lines drive one session per game ID,
+// all sharing the attack tables, the hash table and the network
+struct GameSession {
+    GameSession(string tag, bool pooled) : tag(std::move(tag)), pooled(pooled) {}
+    ~GameSession() { StopSearch(); }
+
+    // The search thread plays its move on the board when it is done, so nothing else may touch the board before
+    void WaitForSearch() {
+        if (search.valid()) search.wait();
+        search = future<void>();
+        activeSearch.reset();
+    }
+
+    void StopSearch() {
+        if (activeSearch) activeSearch->stop.store(true, memory_order_relaxed);
+        WaitForSearch();
+    }
+
+    // Adds a search's or command's counts to this game and to the engine-wide totals
+    void AddStats(const EngineStats& spent) {
+        stats += spent;
+        lock_guard<mutex> lock(statsMutex);
+        engineStats += spent;
+    }
+
+    void EndGame() {
+        StopSearch();
+        DumpGameStats(stats, tag.empty() ? "console" : tag.substr(5, tag.size() - 6));
+        stats = EngineStats{};
+    }
+
+    string tag; // prefix of every line this session prints
+    bool pooled; // server-mode game: single-threaded searches on the shared pool, the hash table is never cleared
+    Board board;
+    string baseFen; // start position of the board's move stack
+    vector<unique_ptr<SearchHistory>> histories;
+    EngineStats stats; // what this game's searches and commands counted so far
+    unique_ptr<SearchShared> activeSearch;
+    future<void> search;
+};
+
+// Commands that act on one game. Returns false for anything else
+bool HandleGameCommand(GameSession& session, const string& line) {
+    if (line == "stop") {
+        session.StopSearch();
+        return true;
+    } else if (line == "ponderhit") {
+        if (session.activeSearch) session.activeSearch->PonderHit();
+        return true;
+    } else if (line == "isready") {
+        EmitLine(session.tag + "readyok");
+        return true;
+    }
+
+    bool gameCommand = line == "ucinewgame" || line.rfind("initial", 0) == 0 || line.rfind("move", 0) == 0
+                    || line.rfind("position", 0) == 0 || line.rfind("go", 0) == 0;
+    if (!gameCommand) return false;
+    session.WaitForSearch();
+    Board& board = session.board;
+    EngineStats before = threadStats;
+
+    if (line == "ucinewgame") {
+        session.EndGame();
+        if (!session.pooled) TT.clear();
+        ClearSearchHistory(session.histories);
+    } else if (line.rfind("initial", 0) == 0) {
+        session.baseFen = extractFen(line);
+        board.setBB(session.baseFen);
+        EmitLine(session.tag + "initialok");
+    } else if (line.rfind("move", 0) == 0) {
+        if (line == "move start") return true;
+        // A bad line from one game must not take the shared server process down
+        string_view uci = string_view(line).substr(min<size_t>(line.size(), 5));
+        Move move = IsUciMove(uci) ? ParseMove(board, uci) : NO_MOVE;
+        if (move != NO_MOVE && IsLegalMove(board, ComputeCheckInfo(board, board.whiteToMove ? WHITE : BLACK), move)) {
+            board.make_move(move);
+        } else {
+            cerr << "[Warning] Illegal move: " << uci << endl;
+        }
+    } else if (line.rfind("position", 0) == 0) {
+        SetPosition(board, session.baseFen, line);
+    } else {
+        session.activeSearch = make_unique<SearchShared>(ParseGoLimits(line), board.whiteToMove);
+        session.activeSearch->outputTag = session.tag;
+        int threadCount = session.pooled ? 1 : searchThreads;
+        auto job = [&session, shared = session.activeSearch.get(), threadCount] {
+            Board& board = session.board;
+            Move bookMove = shared->limits.ponder ? NO_MOVE : openingBook.Probe(board);
+            SearchResult result;
+            if (bookMove != NO_MOVE) {
+                result.move = bookMove;
+            } else {
+                result = SearchPosition(board, *shared, session.histories, threadCount);
+                session.AddStats(result.stats);
+#ifdef USE_STATS
+                EmitLine(session.tag + "info string " + StatsSummary(result.stats));
+#endif
+            }
+
+            // "go ponder" follows the predicted reply sent as a move. A ponder search that ends with
+            // stop instead of ponderhit was a miss: take the prediction back, the real reply comes next
+            if (shared->pondering.load(memory_order_acquire)) {
+                if (!board.history.empty()) board.unmake_move();
+            } else if (result.move != NO_MOVE) {
+                board.make_move(result.move);
+            }
+
+            string reply = session.tag + "bestmove " + (result.move == NO_MOVE ? "0000" : moveToString(result.move));
+            if (result.ponder != NO_MOVE) reply += " ponder " + moveToString(result.ponder);
+            EmitLine(reply);
+        };
+        session.search = session.pooled ? searchPool.Submit(job) : async(launch::async, job);
+    }
+    session.AddStats(threadStats - before);
+    return true;
 }
 
 int main() {
     string line;
 
-    Board board;
+    InitMagics(bishopMagics, bishopTable, bishopDirs);
+    InitMagics(rookMagics, rookTable, rookDirs);
+    InitLines();
+    InitZobrist();
+    InitEval();
+
+    // go runs in the background so stop and ponderhit can reach it
+    GameSession console("", false);
+    map<string, unique_ptr<GameSession>> games; // server mode, by game ID
+    Board& board = console.board;
+
     while (getline(cin, line)) {
+        if (line.rfind("game ", 0) == 0) {
+            size_t idEnd = line.find(' ', 5);
+            string id = line.substr(5, idEnd - 5);
+            string command = idEnd == string::npos ? "" : line.substr(idEnd + 1);
+
+            if (command == "quit") {
+                auto game = games.find(id);
+                if (game != games.end()) game->second->EndGame();
+                games.erase(id);
+                continue;
+            }
+            unique_ptr<GameSession>& session = games[id];
+            if (!session) session = make_unique<GameSession>("game " + id + " ", true);
+            if (!HandleGameCommand(*session, command)) cerr << "[Warning] Unsupported game command: " << command << endl;
+            continue;
+        }
+
+        if (line == "quit") {
+            console.EndGame();
+            for (auto& game : games) game.second->EndGame();
+            break;
+        }
+        if (HandleGameCommand(console, line)) continue;
+        console.WaitForSearch();
+
         if (line == "uci") {
             cout << "id name NeptuneBot" << endl;
             cout << "id author Jupyter" << endl;
+            cout << "option name Hash type spin default 16 min 1 max 65536" << endl;
+            cout << "option name Threads type spin default 1 min 1 max " << MAX_THREADS << endl;
+            cout << "option name EvalFile type string default <empty>" << endl;
+            cout << "option name UseNNUE type check default true" << endl;
+            cout << "option name Ponder type check default false" << endl;
+            cout << "option name BookFile type string default <empty>" << endl;
+            cout << "option name BookDepth type spin default 20 min 0 max 200" << endl;
+            cout << "option name BitbasePath type string default <empty>" << endl;
+            cout << "option name StatsFile type string default <empty>" << endl;
             cout << "uciok" << endl << flush;
-        } else if (line == "isready") {
-            cout << "readyok" << endl << flush;
-        } else if (line.rfind("initial", 0) == 0) {
-            auto start_time = chrono::high_resolution_clock::now();
-
-            string fen = extractFen(line);
-            board.setBB(fen);
-
-            auto end_time = chrono::high_resolution_clock::now();
-            auto duration = chrono::duration_cast<chrono::nanoseconds>(end_time-start_time);
-            cout << "[TIME] Bitboards Generated in " << duration.count() << " ns" << "\n" << flush;
-            cout << "initialok" << endl << flush;
-        } else if (line.rfind("move", 0) == 0) {
-            if (line == "move start") continue;
-            string move = line.substr(5);
-
-            uint8_t from = (move.substr(1, 1)[0] - '1') *8 + (move.substr(0, 1)[0] - 'a');
-            uint8_t to = (move.substr(3, 1)[0] - '1') *8 + (move.substr(2, 1)[0] - 'a');
-
-            bool isEnPassant = false;
-            if (board.hasEnPassant()) {
-                uint64_t pawns = board.whiteToMove ? board.whitePawns : board.blackPawns;
-                isEnPassant = (to == board.getEnPassantTarget()) && ((pawns & bitMasks[from] != 0));
-            }
-            
-            char promotion = 0;
-            if (move.length() == 5) {
-                promotion = move[4];
-            }
-            auto start_time = chrono::high_resolution_clock::now();
-            board.make_move(Move(from, to, promotion, isEnPassant));
-            auto end_time = chrono::high_resolution_clock::now();
-            auto duration = chrono::duration_cast<chrono::nanoseconds>(end_time-start_time);
-            cout << "[TIME] Moves Updated in " << duration.count() << " ns\n" << flush;
+        } else if (line.rfind("setoption", 0) == 0) {
+            // Options change tables every game reads
+            for (auto& game : games) game.second->WaitForSearch();
+            SetOption(line);
         } else if (line.rfind("legal", 0) == 0) {
-            vector<Move> legalMoves = GenerateLegalMoves(board);
+            MoveList legalMoves;
+            GenerateLegalMoves(board, legalMoves);
             cout << "Legal Moves: ";
 
-            for (int i = 0; i < legalMoves.size(); i++) {
-                cout << indexToSquare(legalMoves[i].from) << indexToSquare(legalMoves[i].from);
-                if (legalMoves[i].promotion != 0) {
-                    cout << (char)legalMoves[i].promotion;
-                }
-                cout << " ";
-            }
-
-            cout << flush;
-        } else if (line.rfind("go", 0) == 0) {
-            auto start_time = chrono::high_resolution_clock::now();
-            vector<Move> legalMoves = GenerateLegalMoves(board);
-            std::default_random_engine engine(std::chrono::system_clock::now().time_since_epoch().count());
-            auto end_time = chrono::high_resolution_clock::now();
-            auto duration = chrono::duration_cast<chrono::nanoseconds>(end_time-start_time);
-            cout << "[TIME] " << legalMoves.size() << " Moves Generated in " << duration.count() << " ns\n" << flush;
-            std::uniform_int_distribution<int> dist(0, legalMoves.size() - 1);
-            int randomIndex = dist(engine);
-            Move bestMove = legalMoves[randomIndex];
-            cout << "bestmove " << indexToSquare(bestMove.from) << indexToSquare(bestMove.to);
-            if (bestMove.promotion != 0) {
-                cout << (char)bestMove.promotion;
-            }
-            board.make_move(bestMove);
+            for (Move move : legalMoves) {
+                cout << moveToString(move) << " ";
+            }
+
             cout << endl << flush;
-        } else if (line == "quit") {
-            break;
+        } else if (line == "eval") {
+            PrintEval(board);
+        } else if (line.rfind("perftsuite", 0) == 0) {
+            istringstream iss(line);
+            string command;
+            int depth = 5;
+            iss >> command >> depth;
+            PerftOptions options = ParsePerftOptions(iss);
+            RunPerftSuite(depth, options);
+        } else if (line.rfind("perft", 0) == 0 || line.rfind("divide", 0) == 0) {
+            istringstream iss(line);
+            string command;
+            int depth = 1;
+            iss >> command >> depth;
+            PerftOptions options = ParsePerftOptions(iss);
+            RunPerft(board, depth, options, command == "divide");
+        } else if (line.rfind("buildbook", 0) == 0) {
+            istringstream iss(line);
+            string command, pgnPath, bookPath, option;
+            int depth = 24, threads = max(1u, thread::hardware_concurrency());
+            iss >> command >> pgnPath >> bookPath;
+            while (iss >> option) {
+                if (option == "depth") iss >> depth;
+                else if (option == "threads") iss >> threads;
+            }
+            if (bookPath.empty()) cerr << "[Warning] Usage: buildbook <pgn> <book.bin> [depth N] [threads T]" << endl;
+            else BuildBook(pgnPath, bookPath, depth, max(1, threads));
+        } else if (line.rfind("genbitbase", 0) == 0) {
+            istringstream iss(line);
+            string command, dir, option;
+            int threads = max(1u, thread::hardware_concurrency());
+            vector<uint64_t> materials;
+            bool valid = true;
+            iss >> command >> dir;
+            while (iss >> option) {
+                uint64_t key;
+                if (option == "threads") {
+                    iss >> threads;
+                } else if (option == "3" || option == "4") {
+                    for (uint64_t material : BitbaseMaterials(stoi(option))) materials.push_back(material);
+                } else if (ParseMaterial(option, key)) {
+                    materials.push_back(key);
+                } else {
+                    cerr << "[Warning] Not a material set genbitbase can build: " << option << endl;
+                    valid = false;
+                }
+            }
+            if (materials.empty()) materials = BitbaseMaterials(3);
+            if (dir.empty()) {
+                cerr << "[Warning] Usage: genbitbase <dir> [3|4|<material> ...] [threads T]" << endl;
+            } else if (valid) {
+                // The loaded tables are replaced at the end
+                for (auto& game : games) game.second->WaitForSearch();
+                GenerateBitbases(dir, materials, max(1, threads));
+            }
+        } else if (line.rfind("analyze-epd", 0) == 0) {
+            istringstream iss(line);
+            string command, path, option;
+            int threads = max(1u, thread::hardware_concurrency());
+            SearchLimits limits;
+            limits.quiet = true;
+            iss >> command >> path;
+            while (iss >> option) {
+                if (option == "depth") iss >> limits.depth;
+                else if (option == "nodes") iss >> limits.nodes;
+                else if (option == "movetime") iss >> limits.movetime;
+                else if (option == "threads") iss >> threads;
+            }
+            if (limits.depth == MAX_SEARCH_PLY - 1 && !limits.nodes && limits.movetime < 0) limits.movetime = 1000;
+            if (limits.movetime >= 0) limits.movetime += MOVE_OVERHEAD_MS; // no bridge latency to reserve for
+            limits.depth = max(1, min(limits.depth, MAX_SEARCH_PLY - 1));
+            if (path.empty()) {
+                cerr << "[Warning] Usage: analyze-epd <file> [depth N] [nodes N] [movetime MS] [threads T]" << endl;
+            } else {
+                // The hash table is cleared first
+                for (auto& game : games) game.second->WaitForSearch();
+                AnalyzeEpd(path, limits, max(1, threads));
+            }
+        } else if (line.rfind("match", 0) == 0 || line.rfind("selfplay", 0) == 0) {
+#ifdef __linux__
+            istringstream iss(line);
+            string command, option;
+            MatchSettings settings;
+            settings.concurrency = max(1u, thread::hardware_concurrency() / 2);
+            char self[4096];
+            ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+            string selfPath = length > 0 ? string(self, length) : "";
+            settings.engines[0] = {"engine1", selfPath, {}};
+            settings.engines[1] = {"engine2", selfPath, {}};
+            string openingsPath;
+            bool valid = true;
+            iss >> command;
+            while (iss >> option) {
+                if (option == "games") {
+                    iss >> settings.games;
+                } else if (option == "tc") {
+                    string tc;
+                    iss >> tc;
+                    size_t plus = tc.find('+');
+                    settings.baseMs = (int64_t)(atof(tc.substr(0, plus).c_str()) * 1000);
+                    settings.incMs = plus == string::npos ? 0 : (int64_t)(atof(tc.substr(plus + 1).c_str()) * 1000);
+                } else if (option == "concurrency") {
+                    iss >> settings.concurrency;
+                } else if (option == "openings") {
+                    iss >> openingsPath;
+                } else if (option == "pgn") {
+                    iss >> settings.pgnPath;
+                } else if (option == "sprt") {
+                    settings.sprt = true;
+                    iss >> settings.elo0 >> settings.elo1;
+                } else if (option == "engine1" || option == "engine2") {
+                    iss >> settings.engines[option.back() - '1'].path;
+                } else if (option == "option1" || option == "option2") {
+                    string setting;
+                    iss >> setting;
+                    size_t equals = setting.find('=');
+                    if (equals == string::npos) valid = false;
+                    else settings.engines[option.back() - '1'].options.emplace_back(setting.substr(0, equals), setting.substr(equals + 1));
+                } else {
+                    valid = false;
+                }
+            }
+            if (!openingsPath.empty()) {
+                ifstream file(openingsPath);
+                string epd;
+                Board opening;
+                EpdPosition position;
+                while (getline(file, epd)) {
+                    if (ParseEpd(epd, opening, position)) settings.openings.push_back(position.fen);
+                }
+                if (settings.openings.empty()) {
+                    cerr << "[Warning] No openings in " << openingsPath << endl;
+                    valid = false;
+                }
+            }
+            if (settings.openings.empty()) settings.openings.push_back(START_FEN);
+            // Both sides are this binary unless told otherwise: name them by what sets them apart
+            for (MatchEngine& engine : settings.engines) {
+                if (settings.engines[0].path != settings.engines[1].path) engine.name = engine.path.substr(engine.path.find_last_of('/') + 1);
+                for (const auto& setting : engine.options) engine.name += " " + setting.first + "=" + setting.second;
+            }
+            if (settings.engines[0].name == settings.engines[1].name) settings.engines[1].name += "'";
+            if (!valid || settings.games < 1 || settings.concurrency < 1 || settings.baseMs <= 0) {
+                cerr << "[Warning] Usage: match [games N] [tc <base>+<inc>] [concurrency T] [openings <file>] [pgn <file>] "
+                        "[sprt <elo0> <elo1>] [engine1 <path>] [engine2 <path>] [option1 <name>=<value>] [option2 <name>=<value>]" << endl;
+            } else {
+                RunMatch(settings);
+            }
+#else
+            cerr << "[Warning] match needs Linux to run the engines as child processes" << endl;
+#endif
+        } else if (line.rfind("stats", 0) == 0) {
+#ifdef USE_STATS
+            unique_lock<mutex> lock(statsMutex);
+            if (line == "stats reset") {
+                engineStats = EngineStats{};
+            } else {
+                EngineStats totals = engineStats;
+                lock.unlock();
+                if (line == "stats json") cout << StatsJson(totals, "all") << endl;
+                else PrintStats(totals);
+            }
+#else
+            cout << "info string statistics were compiled out (NEPTUNE_NO_STATS)" << endl;
+#endif
+        } else if (line.rfind("smpbench", 0) == 0) {
+            istringstream iss(line);
+            string command;
+            int64_t movetime = 1000;
+            iss >> command >> movetime;
+            RunSmpBench(movetime);
         }
     }
 
     return 0;
-}
\ No newline at end of file
+}